@@ -29,9 +29,9 @@
  * (compiler option "-I <PATH>" if "Cimg.h" is installed in <PATH>).
  *
  * For linking, additional standard libraries may be needed:
- * - Linux and MacOS X: the libraries "X11" and "pthread".
+ * - Linux and MacOS X: the libraries "X11", "Xext" and "pthread".
  * - MS Windows: the library "gdi32".
- * (linker option "-lX11 -lXpthread" respectively "-lgdi32").
+ * (linker option "-lX11 -lXext -lpthread" respectively "-lgdi32").
  *
  * Eclipse C++ on Linux and MacOS X: create "C++" project
  * - project "Properties" -> "C/C++ General" -> "Paths and Symbols"
@@ -47,7 +47,20 @@
  *****************************************************************************/
 
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include "Drawing.h"
+#include "Tasks.h"
+
+#if cimg_display == 1
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
 
 using namespace std;
 using namespace cimg_library;
@@ -57,32 +70,20 @@ namespace compsys
     // a color component
     typedef unsigned char Color;
 
-    // the image and the display
-    static CImg<Color> *image = NULL;
-    static CImgDisplay *display = NULL;
-    static bool flushing = false;
-
-    // conditionally flush output
-    static void flush0()
-    {
-        if (flushing)
-            display->display(*image);
-    }
+    // a pixel, with its color components at the bit positions of a surface
+    typedef unsigned int Pixel;
 
-    // check for initialization
-    static void checkImage(const char *call)
+    // abort program after a wrong call
+    static void error(const char *call, const char *problem)
     {
-        if (image != NULL)
-            return;
-        cout << "ERROR: " << call << "() is called without previous call of beginDrawing()" << endl;
+        cout << "ERROR: " << call << "() is called " << problem << endl;
         cout << "Program is aborted." << endl;
         exit(-1);
     }
 
     // translate color code to color structure
     // always returns address of carray
-    static Color carray[3];
-    static Color *getColor(unsigned int color)
+    static Color *getColor(unsigned int color, Color carray[3])
     {
         carray[0] = (color >> 16) & 0xFF;
         carray[1] = (color >> 8) & 0xFF;
@@ -90,6 +91,708 @@ namespace compsys
         return carray;
     }
 
+    // the presentation of a window from shared memory (see openShm())
+    struct Shm;
+
+    // the image and the display (NULL for an off-screen surface) of a surface;
+    // the image holds one pixel per word, with the red, green and blue
+    // components at bit positions shifts[0..2]; if the display buffer has
+    // pixels of this kind (native), the image shares its memory with the
+    // buffer and uses its bit positions, so that showing the image is a
+    // straight copy to the window without any conversion; with MIT-SHM
+    // (shm not NULL), the image is instead the back image of the shared
+    // memory images
+    // the mutex serializes the output to the display and guards presentation
+    struct Surface::State
+    {
+        CImg<Pixel> image;
+        int shifts[3];
+        CImgDisplay *display;
+        bool native;
+        Shm *shm;
+        bool flushing;
+        bool accessing;
+        mutex output;
+        Presentation presentation;
+
+        State(int width, int height, unsigned int color)
+            : image(width, height, 1, 1), shifts{16, 8, 0}, display(NULL),
+              native(false), shm(NULL), flushing(false), accessing(false),
+              presentation{false, 0, 0, 0, 0}
+        {
+            image.fill(pack(color));
+        }
+
+        // the pixel of color
+        Pixel pack(unsigned int color) const
+        {
+            return ((color >> 16) & 0xFF) << shifts[0] |
+                   ((color >> 8) & 0xFF) << shifts[1] |
+                   (color & 0xFF) << shifts[2];
+        }
+
+        // the color component c (0 = red, 1 = green, 2 = blue) of pixel
+        Color component(Pixel pixel, int c) const
+        {
+            return (pixel >> shifts[c]) & 0xFF;
+        }
+    };
+
+    // the bit positions of red, green and blue in a pixel of the display
+    // buffer; false if the pixels of the buffer are not words of 32 bits
+    static bool getShifts(int shifts[3])
+    {
+#if cimg_display == 1
+        const cimg::X11_attr &attr = cimg::X11_attr::ref();
+        if (attr.nb_bits == 8 || attr.nb_bits == 16 || sizeof(Pixel) != 4)
+            return false;
+        bool same = attr.byte_order == cimg::endianness();
+        shifts[0] = same ? 16 : 8;
+        shifts[1] = same ? 8 : 16;
+        shifts[2] = same ? 0 : 24;
+        if (attr.is_blue_first)
+            swap(shifts[0], shifts[2]);
+        return true;
+#else
+        (void)shifts;
+        return false;
+#endif
+    }
+
+    // the box of the image from x0,y0 on of the size of planar, in planar
+    // RGB format
+    static void getPlanar(const Surface::State *state, int x0, int y0, CImg<Color> &planar)
+    {
+        const CImg<Pixel> &image = state->image;
+        for (int c = 0; c < 3; c++)
+            cimg_forXY(planar, x, y)
+                planar(x, y, 0, c) = state->component(image(x0 + x, y0 + y), c);
+    }
+
+    // the image in planar RGB format
+    static CImg<Color> getPlanar(const Surface::State *state)
+    {
+        const CImg<Pixel> &image = state->image;
+        CImg<Color> planar(image.width(), image.height(), 1, 3);
+        getPlanar(state, 0, 0, planar);
+        return planar;
+    }
+
+    // set the box of the image from x0,y0 on of the size of planar from
+    // planar RGB format
+    static void setPlanar(Surface::State *state, int x0, int y0, const CImg<Color> &planar)
+    {
+        CImg<Pixel> &image = state->image;
+        cimg_forXY(planar, x, y)
+            image(x0 + x, y0 + y) = state->pack(planar(x, y, 0, 0) << 16 | planar(x, y, 0, 1) << 8 |
+                                                planar(x, y, 0, 2));
+    }
+
+    // set the image from planar RGB format
+    static void setPlanar(Surface::State *state, const CImg<Color> &planar)
+    {
+        setPlanar(state, 0, 0, planar);
+    }
+
+    // add a frame presented with the given latency to the statistics
+    static void account(Surface::State *state, chrono::steady_clock::duration latency)
+    {
+        Presentation &p = state->presentation;
+        p.latency = chrono::duration<double, milli>(latency).count();
+        p.meanLatency = (p.meanLatency * p.frames + p.latency) / (p.frames + 1);
+        p.maxLatency = max(p.maxLatency, p.latency);
+        p.frames++;
+    }
+
+#if cimg_display == 1
+    // two shared memory images (MIT-SHM) of the size of the window, put into
+    // the window over a connection of their own; a task spawned for each
+    // frame puts the front image and waits for the completion event of the
+    // X server, while the surface draws into the back image; pending tells
+    // that the front image is still to be presented (guarded by the output
+    // mutex of the surface)
+    struct Shm
+    {
+        Display *display;
+        Window window;
+        GC gc;
+        int completion;
+        XShmSegmentInfo info[2];
+        XImage *images[2];
+        bool attached[2];
+        int back;
+        bool pending;
+        condition_variable changed;
+        Tasks presenter;
+    };
+
+    // whether an X error occurred while attaching a shared memory segment
+    static bool shmFailed = false;
+
+    static int onShmError(Display *, XErrorEvent *)
+    {
+        shmFailed = true;
+        return 0;
+    }
+
+    // release the shared memory images and the connection
+    static void closeShm(Shm *shm)
+    {
+        for (int b = 0; b < 2; b++)
+        {
+            if (shm->attached[b])
+                XShmDetach(shm->display, &shm->info[b]);
+            if (shm->images[b] != NULL)
+            {
+                shm->images[b]->data = NULL;
+                XDestroyImage(shm->images[b]);
+            }
+            if (shm->info[b].shmaddr != (char *)-1)
+                shmdt(shm->info[b].shmaddr);
+        }
+        XFreeGC(shm->display, shm->gc);
+        XCloseDisplay(shm->display);
+        delete shm;
+    }
+
+    // open the shared memory images for the window of a native surface;
+    // NULL if the X server has no MIT-SHM (e.g. on a remote display) or the
+    // images cannot be created
+    static Shm *openShm(Surface::State *state)
+    {
+        Display *display = XOpenDisplay(DisplayString(cimg::X11_attr::ref().display));
+        if (display == NULL)
+            return NULL;
+        if (!XShmQueryExtension(display))
+        {
+            XCloseDisplay(display);
+            return NULL;
+        }
+        int width = state->image.width();
+        int height = state->image.height();
+        int screen = DefaultScreen(display);
+        Shm *shm = new Shm();
+        shm->display = display;
+        shm->window = state->display->_window;
+        shm->gc = XCreateGC(display, shm->window, 0, NULL);
+        shm->completion = XShmGetEventBase(display) + ShmCompletion;
+        shm->back = 0;
+        shm->pending = false;
+        bool ok = true;
+        for (int b = 0; b < 2; b++)
+        {
+            XShmSegmentInfo &info = shm->info[b];
+            info.shmid = -1;
+            info.shmaddr = (char *)-1;
+            shm->images[b] = NULL;
+            shm->attached[b] = false;
+            if (!ok)
+                continue;
+            XImage *image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                                            ZPixmap, NULL, &info, width, height);
+            shm->images[b] = image;
+            ok = image != NULL && image->bits_per_pixel == 32 &&
+                 image->bytes_per_line == (int)sizeof(Pixel) * width;
+            if (ok)
+                info.shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * height, IPC_CREAT | 0600);
+            ok = ok && info.shmid >= 0;
+            if (ok)
+            {
+                info.shmaddr = image->data = (char *)shmat(info.shmid, NULL, 0);
+                info.readOnly = False;
+                shmFailed = false;
+                XErrorHandler handler = XSetErrorHandler(onShmError);
+                shm->attached[b] = info.shmaddr != (char *)-1 && XShmAttach(display, &info);
+                XSync(display, False);
+                XSetErrorHandler(handler);
+                shm->attached[b] = shm->attached[b] && !shmFailed;
+                ok = shm->attached[b];
+            }
+            // the segment goes away once it is detached
+            if (info.shmid >= 0)
+                shmctl(info.shmid, IPC_RMID, NULL);
+        }
+        if (!ok)
+        {
+            closeShm(shm);
+            return NULL;
+        }
+        return shm;
+    }
+
+    // body of the presenter task of a frame: present the front image
+    static void present(Surface::State *state)
+    {
+        Shm *shm = state->shm;
+        unique_lock<mutex> lock(state->output);
+        XImage *image = shm->images[1 - shm->back];
+        lock.unlock();
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        XShmPutImage(shm->display, shm->window, shm->gc, image,
+                     0, 0, 0, 0, image->width, image->height, True);
+        XEvent event;
+        do
+            XNextEvent(shm->display, &event);
+        while (event.type != shm->completion);
+        chrono::steady_clock::duration latency = chrono::steady_clock::now() - t0;
+        lock.lock();
+        account(state, latency);
+        shm->pending = false;
+        shm->changed.notify_all();
+    }
+
+    // wait until the front image is presented
+    static void settle(Shm *shm, unique_lock<mutex> &lock)
+    {
+        shm->changed.wait(lock, [&] { return !shm->pending; });
+    }
+#endif
+
+    // show image on display (if any); with MIT-SHM, the back image becomes
+    // the front image, which a presenter task puts into the window while the
+    // surface goes on drawing on a copy of it in the other image; otherwise a
+    // native image is already in the display buffer, and any other image is
+    // converted by the display
+    static void show(Surface::State *state)
+    {
+        if (state->display == NULL)
+            return;
+        unique_lock<mutex> lock(state->output);
+#if cimg_display == 1
+        if (state->shm != NULL)
+        {
+            Shm *shm = state->shm;
+            settle(shm, lock);
+            CImg<Pixel> &image = state->image;
+            XImage *front = shm->images[shm->back];
+            shm->back = 1 - shm->back;
+            XImage *back = shm->images[shm->back];
+            memcpy(back->data, front->data, (size_t)front->bytes_per_line * front->height);
+            image.assign((Pixel *)back->data, image.width(), image.height(), 1, 1, true);
+            shm->pending = true;
+            scheduler().spawn(shm->presenter, PRIORITY_NORMAL, [state] { present(state); });
+            return;
+        }
+#endif
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (state->native)
+            state->display->paint(false);
+        else
+            state->display->display(getPlanar(state));
+        account(state, chrono::steady_clock::now() - t0);
+    }
+
+    // conditionally flush output
+    static void flush0(Surface::State *state)
+    {
+        if (state->flushing)
+            show(state);
+    }
+
+    // check for drawing outside of direct access
+    static void checkDrawing(const Surface::State *state, const char *call)
+    {
+        if (state->accessing)
+            error(call, "between beginAccess() and endAccess()");
+    }
+
+    // check for valid dimensions
+    static void checkSize(int width, int height)
+    {
+        if (width >= 0 && height >= 0)
+            return;
+        error("Surface", "with negative width or height");
+    }
+
+    Surface::Surface(int width, int height, unsigned int color)
+    {
+        checkSize(width, height);
+        state = new State(width, height, color);
+    }
+
+    void Surface::open(const char *title, bool flush)
+    {
+        if (state->display != NULL)
+            error("open", "twice in sequence.");
+        CImg<Pixel> &image = state->image;
+        state->display = new CImgDisplay(image.width(), image.height(), title);
+        state->display->move(0, 0);
+        state->flushing = flush;
+#if cimg_display == 1
+        // move the image into the display buffer, in the bit positions of the
+        // display
+        int shifts[3];
+        if (getShifts(shifts))
+        {
+            CImg<Color> planar = getPlanar(state);
+            copy(shifts, shifts + 3, state->shifts);
+            image.assign((Pixel *)state->display->_data, image.width(), image.height(), 1, 1, true);
+            setPlanar(state, planar);
+            state->native = true;
+            // present from shared memory if the X server allows
+            Shm *shm = openShm(state);
+            if (shm != NULL)
+            {
+                XImage *back = shm->images[shm->back];
+                memcpy(back->data, image.data(), (size_t)back->bytes_per_line * back->height);
+                image.assign((Pixel *)back->data, image.width(), image.height(), 1, 1, true);
+                state->shm = shm;
+                state->presentation.shm = true;
+            }
+        }
+#endif
+        show(state);
+    }
+
+    Surface::~Surface()
+    {
+#if cimg_display == 1
+        if (state->shm != NULL)
+        {
+            scheduler().wait(state->shm->presenter);
+            closeShm(state->shm);
+        }
+#endif
+        delete state->display;
+        delete state;
+    }
+
+    void Surface::wait()
+    {
+        checkDrawing(state, "wait");
+        if (state->display == NULL)
+            return;
+        show(state);
+#if cimg_display == 1
+        // leave the last image in the display buffer, from which the window
+        // is redrawn when it is exposed
+        if (state->shm != NULL)
+        {
+            unique_lock<mutex> lock(state->output);
+            settle(state->shm, lock);
+            memcpy(state->display->_data, state->image.data(), state->image.size() * sizeof(Pixel));
+            lock.unlock();
+            state->display->paint(false);
+        }
+#endif
+        while (!state->display->is_closed())
+        {
+            state->display->wait();
+        }
+    }
+
+    void Surface::flush()
+    {
+        checkDrawing(state, "flush");
+        show(state);
+    }
+
+    // the image as rows of interleaved RGB pixels,
+    // each row preceded by filter (if not negative)
+    static vector<Color> getRows(const Surface::State *state, int filter)
+    {
+        const CImg<Pixel> &image = state->image;
+        int w = image.width();
+        int h = image.height();
+        vector<Color> rows;
+        rows.reserve((size_t)(3 * w + (filter >= 0)) * h);
+        for (int y = 0; y < h; y++)
+        {
+            if (filter >= 0)
+                rows.push_back((Color)filter);
+            const Pixel *row = image.data(0, y);
+            for (int x = 0; x < w; x++)
+            {
+                rows.push_back(state->component(row[x], 0));
+                rows.push_back(state->component(row[x], 1));
+                rows.push_back(state->component(row[x], 2));
+            }
+        }
+        return rows;
+    }
+
+    // append value to bytes in big endian order
+    static void putBig(vector<Color> &bytes, unsigned long value)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            bytes.push_back((value >> shift) & 0xFF);
+    }
+
+    // CRC-32 of the bytes as used by PNG
+    static unsigned long crc32(const Color *bytes, size_t n)
+    {
+        static const vector<unsigned long> table = []()
+        {
+            vector<unsigned long> t(256);
+            for (unsigned long i = 0; i < 256; i++)
+            {
+                unsigned long c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+        unsigned long c = 0xFFFFFFFFUL;
+        for (size_t i = 0; i < n; i++)
+            c = table[(c ^ bytes[i]) & 0xFF] ^ (c >> 8);
+        return c ^ 0xFFFFFFFFUL;
+    }
+
+    // append PNG chunk of type with data to png
+    static void putChunk(vector<Color> &png, const char *type, const vector<Color> &data)
+    {
+        putBig(png, data.size());
+        size_t start = png.size();
+        png.insert(png.end(), type, type + 4);
+        png.insert(png.end(), data.begin(), data.end());
+        putBig(png, crc32(&png[start], png.size() - start));
+    }
+
+    // encode image in PNG format; the pixel data are stored in a zlib
+    // stream of uncompressed deflate blocks, which is fast to write
+    static vector<Color> encodePNG(const Surface::State *state)
+    {
+        const CImg<Pixel> &image = state->image;
+        static const Color signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        vector<Color> png(signature, signature + 8);
+
+        vector<Color> header;
+        putBig(header, image.width());
+        putBig(header, image.height());
+        header.push_back(8); // bit depth
+        header.push_back(2); // color type RGB
+        header.push_back(0); // compression
+        header.push_back(0); // filter
+        header.push_back(0); // interlace
+        putChunk(png, "IHDR", header);
+
+        vector<Color> rows = getRows(state, 0);
+        vector<Color> data;
+        data.reserve(rows.size() + rows.size() / 65535 * 5 + 16);
+        data.push_back(0x78);
+        data.push_back(0x01);
+        size_t pos = 0;
+        do
+        {
+            size_t len = min(rows.size() - pos, (size_t)65535);
+            bool last = pos + len == rows.size();
+            data.push_back(last ? 1 : 0);
+            data.push_back(len & 0xFF);
+            data.push_back(len >> 8);
+            data.push_back(~len & 0xFF);
+            data.push_back((~len >> 8) & 0xFF);
+            data.insert(data.end(), rows.begin() + pos, rows.begin() + pos + len);
+            pos += len;
+        } while (pos < rows.size());
+        unsigned long a = 1, b = 0;
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            a = (a + rows[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        putBig(data, (b << 16) | a);
+        putChunk(png, "IDAT", data);
+        putChunk(png, "IEND", vector<Color>());
+        return png;
+    }
+
+    bool Surface::save(const char *filename) const
+    {
+        const CImg<Pixel> &image = state->image;
+        size_t len = strlen(filename);
+        bool png = len >= 4 && strcmp(filename + len - 4, ".png") == 0;
+        ofstream out(filename, ios::binary);
+        if (png)
+        {
+            vector<Color> bytes = encodePNG(state);
+            out.write((const char *)bytes.data(), bytes.size());
+        }
+        else
+        {
+            vector<Color> bytes = getRows(state, -1);
+            out << "P6\n" << image.width() << " " << image.height() << "\n255\n";
+            out.write((const char *)bytes.data(), bytes.size());
+        }
+        out.close();
+        return !out.fail();
+    }
+
+    Presentation Surface::getPresentation() const
+    {
+        lock_guard<mutex> lock(state->output);
+        return state->presentation;
+    }
+
+    int Surface::getWidth() const
+    {
+        return state->image.width();
+    }
+
+    int Surface::getHeight() const
+    {
+        return state->image.height();
+    }
+
+    Framebuffer Surface::beginAccess()
+    {
+        checkDrawing(state, "beginAccess");
+        state->accessing = true;
+        // byte offset of each color component within a pixel
+        int offsets[3];
+        for (int c = 0; c < 3; c++)
+            offsets[c] = cimg::endianness() ? 3 - state->shifts[c] / 8 : state->shifts[c] / 8;
+        Framebuffer fb;
+        fb.pixels = (unsigned char *)state->image.data() + offsets[0];
+        fb.width = state->image.width();
+        fb.height = state->image.height();
+        fb.stride = (long)sizeof(Pixel) * state->image.width();
+        fb.pixelStride = sizeof(Pixel);
+        fb.channelStride = offsets[1] - offsets[0];
+        fb.channels = 3;
+        fb.layout = INTERLEAVED;
+        fb.words = state->image.data();
+        copy(state->shifts, state->shifts + 3, fb.shifts);
+        return fb;
+    }
+
+    void Surface::endAccess()
+    {
+        if (!state->accessing)
+            error("endAccess", "without previous call of beginAccess()");
+        state->accessing = false;
+        flush0(state);
+    }
+
+    void Surface::drawPoint(int x, int y, unsigned int color)
+    {
+        checkDrawing(state, "drawPoint");
+        Pixel pixel = state->pack(color);
+        state->image.draw_point(x, y, &pixel);
+        flush0(state);
+    }
+
+    void Surface::drawLine(int x0, int y0, int x1, int y1, unsigned int color)
+    {
+        checkDrawing(state, "drawLine");
+        Pixel pixel = state->pack(color);
+        state->image.draw_line(x0, y0, x1, y1, &pixel);
+        flush0(state);
+    }
+
+    void Surface::drawRectangle(int x, int y, int w, int h, unsigned int color)
+    {
+        checkDrawing(state, "drawRectangle");
+        Pixel pixel = state->pack(color);
+        const Pixel *color0 = &pixel;
+        CImg<Pixel> &image = state->image;
+        image.draw_line(x, y, x + w, y, color0);
+        image.draw_line(x + w, y, x + w, y + h, color0);
+        image.draw_line(x + w, y + h, x, y + h, color0);
+        image.draw_line(x, y + h, x, y, color0);
+        flush0(state);
+    }
+
+    void Surface::fillRectangle(int x, int y, int w, int h,
+                                unsigned int fcolor, unsigned int ocolor)
+    {
+        checkDrawing(state, "fillRectangle");
+        Pixel pixel = state->pack(fcolor);
+        state->image.draw_rectangle(x, y, x + w, y + h, &pixel);
+        if (ocolor != NO_COLOR)
+            drawRectangle(x, y, w, h, ocolor);
+        flush0(state);
+    }
+
+    void Surface::drawEllipse(int x, int y, int w, int h, unsigned int color)
+    {
+        checkDrawing(state, "drawEllipse");
+        Pixel pixel = state->pack(color);
+        int w0 = w / 2;
+        int h0 = h / 2;
+        state->image.draw_ellipse(x + w0, y + h0, w0, h0, 0, &pixel, 1, 1);
+        flush0(state);
+    }
+
+    void Surface::fillEllipse(int x, int y, int w, int h,
+                              unsigned int fcolor, unsigned int ocolor)
+    {
+        checkDrawing(state, "fillEllipse");
+        Pixel pixel = state->pack(fcolor);
+        int w0 = w / 2;
+        int h0 = h / 2;
+        state->image.draw_ellipse(x + w0, y + h0, w0, h0, 0, &pixel);
+        if (ocolor != NO_COLOR)
+            drawEllipse(x, y, w, h, ocolor);
+        flush0(state);
+    }
+
+    void Surface::drawPolygon(int n, int *xs, int *ys, unsigned int color)
+    {
+        checkDrawing(state, "drawPolygon");
+        Pixel pixel = state->pack(color);
+        const Pixel *color0 = &pixel;
+        CImg<Pixel> &image = state->image;
+        for (int i = 0; i < n - 1; i++)
+        {
+            image.draw_line(xs[i], ys[i], xs[i + 1], ys[i + 1], color0);
+        }
+        if (n > 0)
+            image.draw_line(xs[n - 1], ys[n - 1], xs[0], ys[0], color0);
+        flush0(state);
+    }
+
+    void Surface::fillPolygon(int n, int *xs, int *ys,
+                              unsigned int fcolor, unsigned int ocolor)
+    {
+        checkDrawing(state, "fillPolygon");
+        Pixel pixel = state->pack(fcolor);
+        CImg<int> npoints(n, 2);
+        for (int i = 0; i < n; i++)
+        {
+            npoints(i, 0) = xs[i];
+            npoints(i, 1) = ys[i];
+        }
+        state->image.draw_polygon(npoints, &pixel);
+        if (ocolor != NO_COLOR)
+            drawPolygon(n, xs, ys, ocolor);
+        flush0(state);
+    }
+
+    void Surface::drawText(int x, int y, const char *text,
+                           int size, unsigned int color)
+    {
+        checkDrawing(state, "drawText");
+        // text is blended into the background per color component, so it is
+        // drawn on a planar copy of the box of the image it covers, measured
+        // by drawing it on an empty image (which takes the size of the text)
+        Color carray[3];
+        getColor(color, carray);
+        CImg<Color> extent;
+        extent.draw_text(0, 0, text, carray, 0, 1, size);
+        const CImg<Pixel> &image = state->image;
+        int x0 = max(x, 0), y0 = max(y, 0);
+        int x1 = min(x + extent.width(), image.width()), y1 = min(y + extent.height(), image.height());
+        if (x0 < x1 && y0 < y1)
+        {
+            CImg<Color> planar(x1 - x0, y1 - y0, 1, 3);
+            getPlanar(state, x0, y0, planar);
+            planar.draw_text(x - x0, y - y0, text, carray, 0, 1, size);
+            setPlanar(state, x0, y0, planar);
+        }
+        flush0(state);
+    }
+
+    // the surface opened by beginDrawing()
+    static Surface *surface = NULL;
+
+    // check for initialization
+    static void checkImage(const char *call)
+    {
+        if (surface == NULL)
+            error(call, "without previous call of beginDrawing()");
+    }
+
     /***************************************************************************
      * beginDrawing(width, height, title, color, flush)
      * Open a window of size width*height with title and background color
@@ -107,17 +810,10 @@ namespace compsys
     void beginDrawing(int width, int height, const char *title,
                       unsigned int color, bool flush)
     {
-        if (image != NULL)
-        {
-            cout << "ERROR: beginDrawing() is called twice in sequence.";
-            cout << "Program is aborted.";
-            exit(-1);
-        }
-        image = new CImg<Color>(width, height, 1, 3);
-        image->draw_rectangle(0, 0, width, height, getColor(color));
-        display = new CImgDisplay(*image, title);
-        display->move(0, 0);
-        flushing = flush;
+        if (surface != NULL)
+            error("beginDrawing", "twice in sequence.");
+        surface = new Surface(width, height, color);
+        surface->open(title, flush);
     }
 
     /***************************************************************************
@@ -131,16 +827,22 @@ namespace compsys
     void endDrawing()
     {
         checkImage("endDrawing");
-        display->display(*image);
-        while (!display->is_closed())
-        {
-            display->wait();
-        }
-        delete image;
-        delete display;
-        image = NULL;
-        display = NULL;
-        flushing = false;
+        surface->wait();
+        delete surface;
+        surface = NULL;
+    }
+
+    /***************************************************************************
+     * surface = getSurface()
+     * Get the surface opened by beginDrawing(), on which the free drawing
+     * functions draw.
+     *
+     * May be called only after a previous call of beginDrawing().
+     **************************************************************************/
+    Surface &getSurface()
+    {
+        checkImage("getSurface");
+        return *surface;
     }
 
     /***************************************************************************
@@ -152,7 +854,37 @@ namespace compsys
     void flush()
     {
         checkImage("flush");
-        display->display(*image);
+        surface->flush();
+    }
+
+    /***************************************************************************
+     * fb = beginAccess()
+     * Gives direct access to the pixels of the current image as described by
+     * the returned framebuffer fb, which remains valid until endAccess().
+     *
+     * May be called only after a previous call of beginDrawing(). Until the
+     * matching call of endAccess(), no drawing function and neither flush()
+     * nor endDrawing() may be called, nor beginAccess() again (see Surface
+     * for threads sharing the access). Writes outside the dimensions of the
+     * framebuffer are not clipped.
+     **************************************************************************/
+    Framebuffer beginAccess()
+    {
+        checkImage("beginAccess");
+        return surface->beginAccess();
+    }
+
+    /***************************************************************************
+     * endAccess()
+     * Ends the direct access started by beginAccess(); if output flush is
+     * enabled, the modified image becomes immediately visible.
+     *
+     * May be called only after a previous call of beginAccess().
+     **************************************************************************/
+    void endAccess()
+    {
+        checkImage("endAccess");
+        surface->endAccess();
     }
 
     /***************************************************************************
@@ -164,7 +896,7 @@ namespace compsys
     int getWidth()
     {
         checkImage("getWidth");
-        return image->width();
+        return surface->getWidth();
     }
 
     /***************************************************************************
@@ -176,7 +908,7 @@ namespace compsys
     int getHeight()
     {
         checkImage("getHeight");
-        return image->height();
+        return surface->getHeight();
     }
 
     /**************************************************************************
@@ -188,8 +920,7 @@ namespace compsys
     void drawPoint(int x, int y, unsigned int color)
     {
         checkImage("drawPoint");
-        image->draw_point(x, y, getColor(color));
-        flush0();
+        surface->drawPoint(x, y, color);
     }
 
     /**************************************************************************
@@ -201,8 +932,7 @@ namespace compsys
     void drawLine(int x0, int y0, int x1, int y1, unsigned int color)
     {
         checkImage("drawLine");
-        image->draw_line(x0, y0, x1, y1, getColor(color));
-        flush0();
+        surface->drawLine(x0, y0, x1, y1, color);
     }
 
     /**************************************************************************
@@ -215,12 +945,7 @@ namespace compsys
     void drawRectangle(int x, int y, int w, int h, unsigned int color)
     {
         checkImage("drawRectangle");
-        Color *color0 = getColor(color);
-        image->draw_line(x, y, x + w, y, color0);
-        image->draw_line(x + w, y, x + w, y + h, color0);
-        image->draw_line(x + w, y + h, x, y + h, color0);
-        image->draw_line(x, y + h, x, y, color0);
-        flush0();
+        surface->drawRectangle(x, y, w, h, color);
     }
 
     /**************************************************************************
@@ -235,10 +960,7 @@ namespace compsys
                        unsigned int fcolor, unsigned int ocolor)
     {
         checkImage("fillRectangle");
-        image->draw_rectangle(x, y, x + w, y + h, getColor(fcolor));
-        if (ocolor != NO_COLOR)
-            drawRectangle(x, y, w, h, ocolor);
-        flush0();
+        surface->fillRectangle(x, y, w, h, fcolor, ocolor);
     }
 
     /**************************************************************************
@@ -251,10 +973,7 @@ namespace compsys
     void drawEllipse(int x, int y, int w, int h, unsigned int color)
     {
         checkImage("drawEllipse");
-        int w0 = w / 2;
-        int h0 = h / 2;
-        image->draw_ellipse(x + w0, y + h0, w0, h0, 0, getColor(color), 1, 1);
-        flush0();
+        surface->drawEllipse(x, y, w, h, color);
     }
 
     /**************************************************************************
@@ -269,12 +988,7 @@ namespace compsys
                      unsigned int fcolor, unsigned int ocolor)
     {
         checkImage("fillEllipse");
-        int w0 = w / 2;
-        int h0 = h / 2;
-        image->draw_ellipse(x + w0, y + h0, w0, h0, 0, getColor(fcolor));
-        if (ocolor != NO_COLOR)
-            drawEllipse(x, y, w, h, ocolor);
-        flush0();
+        surface->fillEllipse(x, y, w, h, fcolor, ocolor);
     }
 
     /**************************************************************************
@@ -287,14 +1001,7 @@ namespace compsys
     void drawPolygon(int n, int *xs, int *ys, unsigned int color)
     {
         checkImage("drawPolygon");
-        Color *color0 = getColor(color);
-        for (int i = 0; i < n - 1; i++)
-        {
-            image->draw_line(xs[i], ys[i], xs[i + 1], ys[i + 1], color0);
-        }
-        if (n > 0)
-            image->draw_line(xs[n - 1], ys[n - 1], xs[0], ys[0], color0);
-        flush0();
+        surface->drawPolygon(n, xs, ys, color);
     }
 
     /**************************************************************************
@@ -308,16 +1015,7 @@ namespace compsys
                      unsigned int fcolor, unsigned int ocolor)
     {
         checkImage("fillPolygon");
-        CImg<int> npoints(n, 2);
-        for (int i = 0; i < n; i++)
-        {
-            npoints(i, 0) = xs[i];
-            npoints(i, 1) = ys[i];
-        }
-        image->draw_polygon(npoints, getColor(fcolor));
-        if (ocolor != NO_COLOR)
-            drawPolygon(n, xs, ys, ocolor);
-        flush0();
+        surface->fillPolygon(n, xs, ys, fcolor, ocolor);
     }
 
     /**************************************************************************
@@ -331,7 +1029,6 @@ namespace compsys
                   int size, unsigned int color)
     {
         checkImage("drawText");
-        image->draw_text(x, y, text, getColor(color), 0, 1, size);
-        flush0();
+        surface->drawText(x, y, text, size, color);
     }
 }
\ No newline at end of file
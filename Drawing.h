@@ -42,6 +42,258 @@ namespace compsys
     // indicator for not a color
     const unsigned int NO_COLOR = 0x1000000;
 
+    /***************************************************************************
+     * Framebuffer
+     * Describes the raw pixels of the current image for direct access. The
+     * color component c (0 = red, 1 = green, 2 = blue) of the pixel at x,y is
+     *
+     *   pixels[y*stride + x*pixelStride + c*channelStride]
+     *
+     * with strides given in bytes. The layout tells whether the components
+     * are stored in separate planes (PLANAR, pixelStride is 1) or next to
+     * each other per pixel (INTERLEAVED, channelStride is +1 or -1).
+     *
+     * If each pixel is a word of its own (words is not NULL), the pixel at x,y
+     * is also words[y*stride/4 + x], with the color component c at the bits
+     * shifts[c] to shifts[c]+7; writing whole words is faster than writing
+     * the components one by one. On a window, these pixels are in the format
+     * of the display, so that flushing them needs no conversion.
+     **************************************************************************/
+    enum Layout { PLANAR, INTERLEAVED };
+
+    struct Framebuffer
+    {
+        unsigned char *pixels;
+        int width, height;
+        long stride;
+        long pixelStride;
+        long channelStride;
+        int channels;
+        Layout layout;
+        unsigned int *words;
+        int shifts[3];
+    };
+
+    /***************************************************************************
+     * Presentation
+     * Statistics of the frames shown in the window of a surface: whether they
+     * are presented from shared memory images (MIT-SHM), in which case the
+     * X server reads them directly, or copied over the connection to the
+     * X server; the number of frames presented and the latency (in ms) of
+     * the last one, and the mean and maximum latency over all of them. With
+     * MIT-SHM, the latency is the time from handing a frame to the X server
+     * until the server reports it drawn; otherwise, it is the time taken to
+     * send the frame.
+     **************************************************************************/
+    struct Presentation
+    {
+        bool shm;
+        long frames;
+        double latency;
+        double meanLatency;
+        double maxLatency;
+    };
+
+    /***************************************************************************
+     * Surface
+     * A drawing surface of its own: an image with an optional window. The
+     * member functions behave like the free functions of the same name below,
+     * which draw on the surface opened by beginDrawing().
+     *
+     * A surface keeps all of its state to itself, so different threads may
+     * draw on different surfaces at the same time. Several threads may also
+     * draw on the same surface at the same time, provided that the pixels
+     * they touch are disjoint (e.g. separate regions of the image) and output
+     * flush is disabled; flush() is then called once all threads are done.
+     *
+     * Direct access has a single owner: only one beginAccess() may be active
+     * on a surface at a time (a second one aborts the program). Threads that
+     * write pixels directly share the one framebuffer it returns, each
+     * writing disjoint pixels, and the owner calls endAccess() once all of
+     * them are done.
+     **************************************************************************/
+    class Surface
+    {
+    public:
+        /***********************************************************************
+         * Surface(width, height, color)
+         * Create an off-screen surface of size width*height with background
+         * color (default white); it has no window, so no display is needed.
+         *
+         * Precondition: width and height must be non-negative.
+         **********************************************************************/
+        Surface(int width, int height, unsigned int color = 0xFFFFFF);
+
+        /***********************************************************************
+         * open(title, flush)
+         * Show the surface in a window with title and output flush
+         * potentially enabled (default yes), like beginDrawing().
+         *
+         * Must not be called twice.
+         * Precondition: title must not be NULL.
+         **********************************************************************/
+        void open(const char *title, bool flush = true);
+
+        /***********************************************************************
+         * ~Surface()
+         * Close the window of the surface (if any) and release its image.
+         **********************************************************************/
+        ~Surface();
+
+        Surface(const Surface &) = delete;
+        Surface &operator=(const Surface &) = delete;
+
+        /***********************************************************************
+         * wait()
+         * Makes the effect of all drawing operations visible and waits until
+         * the user closes the window of the surface (immediately returns for
+         * an off-screen surface), like endDrawing().
+         **********************************************************************/
+        void wait();
+
+        /***********************************************************************
+         * flush()
+         * Flush any pending drawing output to the window of the surface
+         * (does nothing for an off-screen surface).
+         **********************************************************************/
+        void flush();
+
+        /***********************************************************************
+         * ok = save(filename)
+         * Save the image of the surface to the file of the given name, in
+         * PNG format if the name ends with ".png" and in binary PPM format
+         * otherwise; ok tells whether the file could be written.
+         *
+         * May be called from another thread than the one drawing, but not
+         * at the same time as drawing on the surface.
+         * Precondition: filename must not be NULL.
+         **********************************************************************/
+        bool save(const char *filename) const;
+
+        /***********************************************************************
+         * p = getPresentation()
+         * Get the statistics p of the frames shown in the window of the
+         * surface so far (no frames for an off-screen surface).
+         *
+         * With MIT-SHM, a flush hands the frame to the X server and returns
+         * at once, while the frame is drawn into the window in the background;
+         * drawing goes on in a second image, and the next flush waits until
+         * the previous frame is drawn.
+         **********************************************************************/
+        Presentation getPresentation() const;
+
+        /***********************************************************************
+         * w = getWidth()
+         * Get width w of the image of the surface.
+         **********************************************************************/
+        int getWidth() const;
+
+        /***********************************************************************
+         * h = getHeight()
+         * Get height h of the image of the surface.
+         **********************************************************************/
+        int getHeight() const;
+
+        /***********************************************************************
+         * fb = beginAccess()
+         * Gives direct access to the pixels of the image of the surface as
+         * described by the returned framebuffer fb, which remains valid until
+         * endAccess().
+         *
+         * Until the matching call of endAccess(), no drawing function and
+         * neither flush() nor wait() may be called on the surface, nor
+         * beginAccess() again (a second call aborts the program). Writes
+         * outside the dimensions of the framebuffer are not clipped.
+         **********************************************************************/
+        Framebuffer beginAccess();
+
+        /***********************************************************************
+         * endAccess()
+         * Ends the direct access started by beginAccess(); if output flush is
+         * enabled, the modified image becomes immediately visible.
+         *
+         * May be called only after a previous call of beginAccess().
+         **********************************************************************/
+        void endAccess();
+
+        /***********************************************************************
+         * drawPoint(x, y, color)
+         * Draws a point at position x,y in the denoted color (default black).
+         **********************************************************************/
+        void drawPoint(int x, int y, unsigned int color = 0);
+
+        /***********************************************************************
+         * drawLine(x0, y0, x1, y1, color)
+         * Draws a line from x0,y0 to x1,y1 in the denoted color (default
+         * black).
+         **********************************************************************/
+        void drawLine(int x0, int y0, int x1, int y1, unsigned int color = 0);
+
+        /***********************************************************************
+         * drawRectangle(x, y, w, h, color)
+         * Draws an outlined rectangle with left upper corner at position x,y
+         * and dimension w*h in the denoted color (default black).
+         **********************************************************************/
+        void drawRectangle(int x, int y, int w, int h, unsigned int color = 0);
+
+        /***********************************************************************
+         * fillRectangle(x, y, w, h, fcolor, ocolor)
+         * Draws a filled rectangle with left upper corner at position x,y
+         * and dimension w*h in the denoted fill color (default black) and
+         * outline color (default no outline).
+         **********************************************************************/
+        void fillRectangle(int x, int y, int w, int h,
+                           unsigned int fcolor = 0, unsigned int ocolor = NO_COLOR);
+
+        /***********************************************************************
+         * drawEllipse(x, y, w, h, color)
+         * Draws an outlined ellipse whose bounding rectangle has left upper
+         * corner at position x,y and dimension w*h in the denoted color
+         * (default black).
+         **********************************************************************/
+        void drawEllipse(int x, int y, int w, int h, unsigned int color = 0);
+
+        /***********************************************************************
+         * fillEllipse(x, y, w, h, fcolor, ocolor)
+         * Draws a filled ellipse whose bounding rectangle has left upper
+         * corner at position x,y and dimension w*h in the denoted fill color
+         * (default black) and outline color (default no outline).
+         **********************************************************************/
+        void fillEllipse(int x, int y, int w, int h,
+                         unsigned int fcolor = 0, unsigned int ocolor = NO_COLOR);
+
+        /***********************************************************************
+         * drawPolygon(n, xs, ys, color)
+         * Draws an outlined closed polygon with n points at position xs[i],
+         * ys[i] in the denoted color (default black).
+         **********************************************************************/
+        void drawPolygon(int n, int *xs, int *ys, unsigned int color = 0);
+
+        /***********************************************************************
+         * fillPolygon(n, xs, ys, fcolor, ocolor)
+         * Draws a filled closed polygon with n points at position xs[i], ys[i]
+         * in the denoted fill color (default black) and outline color
+         * (default none).
+         **********************************************************************/
+        void fillPolygon(int n, int *xs, int *ys,
+                         unsigned int fcolor = 0, unsigned int ocolor = NO_COLOR);
+
+        /***********************************************************************
+         * drawText(x, y, text, size, color)
+         * Draws text whose left upper corner has position x,y in denoted size
+         * (default 14) and color (default black); only the pixels of the box
+         * covered by the text are touched.
+         **********************************************************************/
+        void drawText(int x, int y, const char *text,
+                      int size = 14, unsigned int color = 0);
+
+        // the state of a surface is private to the implementation
+        struct State;
+
+    private:
+        State *state;
+    };
+
     /***************************************************************************
      * beginDrawing(width, height, title, color, flush)
      * Open a window of size width*height with title and background color
@@ -69,6 +321,15 @@ namespace compsys
      **************************************************************************/
     void endDrawing();
 
+    /***************************************************************************
+     * surface = getSurface()
+     * Get the surface opened by beginDrawing(), on which the free drawing
+     * functions draw.
+     *
+     * May be called only after a previous call of beginDrawing().
+     **************************************************************************/
+    Surface &getSurface();
+
     /***************************************************************************
      * flush()
      * Flush any pending drawing output to the screen.
@@ -77,6 +338,28 @@ namespace compsys
      **************************************************************************/
     void flush();
 
+    /***************************************************************************
+     * fb = beginAccess()
+     * Gives direct access to the pixels of the current image as described by
+     * the returned framebuffer fb, which remains valid until endAccess().
+     *
+     * May be called only after a previous call of beginDrawing(). Until the
+     * matching call of endAccess(), no drawing function and neither flush()
+     * nor endDrawing() may be called, nor beginAccess() again (see Surface
+     * for threads sharing the access). Writes outside the dimensions of the
+     * framebuffer are not clipped.
+     **************************************************************************/
+    Framebuffer beginAccess();
+
+    /***************************************************************************
+     * endAccess()
+     * Ends the direct access started by beginAccess(); if output flush is
+     * enabled, the modified image becomes immediately visible.
+     *
+     * May be called only after a previous call of beginAccess().
+     **************************************************************************/
+    void endAccess();
+
     /***************************************************************************
      * w = getWidth()
      * Get width w of current image.
@@ -0,0 +1,294 @@
+/******************************************************************************
+ * Tasks.h
+ * Interface to a work-stealing task scheduler, shared by the simulation, the
+ * drawing and the output, so that they run on one set of threads instead of
+ * threads of their own.
+ *****************************************************************************/
+
+#ifndef COMPSYS_TASKS_H_
+#define COMPSYS_TASKS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace compsys
+{
+    /***************************************************************************
+     * Priority
+     * The kind of a task:
+     * PRIORITY_HIGH for the chunks of parallel loops, which the simulation
+     * waits for in every frame and which never block, PRIORITY_NORMAL for
+     * presenting frames in a window and PRIORITY_LOW for writing files, both
+     * of which block; see Scheduler for where each of them runs.
+     **************************************************************************/
+    enum Priority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW, PRIORITIES };
+
+    /***************************************************************************
+     * BLOCKING_THREADS
+     * The number of threads of the lane of each priority (none for
+     * PRIORITY_HIGH, whose tasks run on the workers): one presenter, and as
+     * many writers as the snapshots written at the same time.
+     **************************************************************************/
+    inline constexpr int BLOCKING_THREADS[PRIORITIES] = {0, 1, 4};
+
+    /***************************************************************************
+     * Tasks
+     * A group of spawned tasks, to wait for all of them at once; pending is
+     * the number of tasks of the group that have not yet finished.
+     **************************************************************************/
+    struct Tasks
+    {
+        std::atomic<int> pending{0};
+    };
+
+    /***************************************************************************
+     * Scheduler
+     * A set of worker threads running spawned tasks of PRIORITY_HIGH. Each
+     * worker has a deque of tasks per priority: it pushes the tasks it spawns
+     * at the back of its own deque and takes them from there (the latest
+     * first, whose data are still in its cache); once its deques are empty,
+     * it steals from the front of the deques of the others (the oldest first,
+     * which are usually the largest). The tasks spawned by other threads go
+     * to a deque shared by them.
+     *
+     * A task runs to its end on the thread that took it, so a task that
+     * blocks (e.g. on a write) keeps its thread meanwhile. The tasks of
+     * PRIORITY_NORMAL and PRIORITY_LOW, which block, therefore never run on
+     * the workers but in a lane of their own per priority, of
+     * BLOCKING_THREADS[priority] threads taking them from the same deques:
+     * at most that many of them run at the same time, the others wait for a
+     * thread of the lane, and the workers are always left to the parallel
+     * loops. Tasks must not wait for tasks of a lower priority, nor for more
+     * tasks of their own priority than there are threads in its lane.
+     **************************************************************************/
+    class Scheduler
+    {
+    public:
+        /***********************************************************************
+         * Scheduler(workers)
+         * Start a scheduler with the given number of worker threads, and the
+         * threads of the lanes.
+         *
+         * Precondition: workers must be positive.
+         **********************************************************************/
+        explicit Scheduler(int workers);
+
+        /***********************************************************************
+         * ~Scheduler()
+         * Run the tasks still waiting and stop the worker and lane threads.
+         **********************************************************************/
+        ~Scheduler();
+
+        Scheduler(const Scheduler &) = delete;
+        Scheduler &operator=(const Scheduler &) = delete;
+
+        /***********************************************************************
+         * threads = getThreads()
+         * Get the number of threads that run the chunks of a parallel loop:
+         * the thread waiting for the loop and the workers, but no more than
+         * there are processors.
+         **********************************************************************/
+        int getThreads() const;
+
+        /***********************************************************************
+         * spawn(tasks, priority, task)
+         * Add the function task to the group tasks and have it run with the
+         * given priority, by a worker or by a thread of the lane.
+         *
+         * The group must live until wait(tasks) returns.
+         **********************************************************************/
+        void spawn(Tasks &tasks, Priority priority, std::function<void()> task);
+
+        /***********************************************************************
+         * wait(tasks)
+         * Wait until all tasks of the group have finished; meanwhile, the
+         * calling thread runs tasks of PRIORITY_HIGH itself (its own or any
+         * others), but never slower ones, so that it does not get stuck in
+         * writing a file.
+         **********************************************************************/
+        void wait(Tasks &tasks);
+
+    private:
+        struct Task
+        {
+            std::function<void()> run;
+            Tasks *tasks;
+        };
+
+        struct Queue
+        {
+            std::mutex lock;
+            std::deque<Task> tasks[PRIORITIES];
+        };
+
+        // the deques of the workers, then the one of all other threads
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::vector<std::thread> lanes;
+        std::atomic<int> queued[PRIORITIES];
+        std::mutex lock;
+        std::condition_variable idle[PRIORITIES];  // a task is queued, for the threads of its priority
+        std::condition_variable finished;          // a group finished, for wait()
+        bool done;
+        int threads;
+
+        // the number of the worker running on this thread (its deque), or -1
+        static thread_local int self;
+
+        bool take(int queue, int priority, bool back, Task &task);
+        bool runOne(int priority);
+        void work(int worker, int priority);
+    };
+
+    /***************************************************************************
+     * s = scheduler()
+     * Get the scheduler s of the process, with a worker for each processor
+     * but one (at least one worker) and the lanes, started by the first call.
+     *
+     * It is never destroyed, so that exiting does not wait for its tasks.
+     **************************************************************************/
+    Scheduler &scheduler();
+
+    // implementation, in the header so that the scheduler needs no library
+    // of its own
+
+    inline thread_local int Scheduler::self = -1;
+
+    inline Scheduler::Scheduler(int workers) : done(false)
+    {
+        int processors = static_cast<int>(std::thread::hardware_concurrency());
+        threads = std::max(1, std::min(workers + 1, processors));
+        for (int p = 0; p < PRIORITIES; p++)
+            queued[p] = 0;
+        for (int w = 0; w <= workers; w++)
+            queues.emplace_back(new Queue());
+        for (int w = 0; w < workers; w++)
+            this->workers.emplace_back(&Scheduler::work, this, w, PRIORITY_HIGH);
+        for (int p = 0; p < PRIORITIES; p++)
+            for (int t = 0; t < BLOCKING_THREADS[p]; t++)
+                lanes.emplace_back(&Scheduler::work, this, -1, p);
+    }
+
+    inline Scheduler::~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        for (int p = 0; p < PRIORITIES; p++)
+            idle[p].notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+        for (std::thread &lane : lanes)
+            lane.join();
+    }
+
+    inline int Scheduler::getThreads() const
+    {
+        return threads;
+    }
+
+    inline void Scheduler::spawn(Tasks &tasks, Priority priority, std::function<void()> task)
+    {
+        tasks.pending++;
+        Queue &queue = *queues[self >= 0 ? self : workers.size()];
+        {
+            std::lock_guard<std::mutex> guard(queue.lock);
+            queue.tasks[priority].push_back(Task{std::move(task), &tasks});
+        }
+        queued[priority]++;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+        }
+        idle[priority].notify_one();
+        if (priority == PRIORITY_HIGH)
+            finished.notify_all();
+    }
+
+    inline void Scheduler::wait(Tasks &tasks)
+    {
+        while (tasks.pending > 0)
+        {
+            if (runOne(PRIORITY_HIGH))
+                continue;
+            std::unique_lock<std::mutex> guard(lock);
+            finished.wait(guard, [&] { return tasks.pending == 0 || queued[PRIORITY_HIGH] > 0; });
+        }
+    }
+
+    // take a task of the given priority from the back or front of a deque
+    inline bool Scheduler::take(int queue, int priority, bool back, Task &task)
+    {
+        Queue &q = *queues[queue];
+        std::lock_guard<std::mutex> guard(q.lock);
+        std::deque<Task> &tasks = q.tasks[priority];
+        if (tasks.empty())
+            return false;
+        task = std::move(back ? tasks.back() : tasks.front());
+        if (back)
+            tasks.pop_back();
+        else
+            tasks.pop_front();
+        queued[priority]--;
+        return true;
+    }
+
+    // run a task of the given priority, if there is one, from the own deque
+    // before stealing
+    inline bool Scheduler::runOne(int priority)
+    {
+        const int count = static_cast<int>(queues.size());
+        const int own = self >= 0 ? self : count - 1;
+        Task task;
+        bool found = false;
+        if (queued[priority] > 0)
+        {
+            found = take(own, priority, true, task);
+            for (int k = 1; k < count && !found; k++)
+                found = take((own + k) % count, priority, false, task);
+        }
+        if (!found)
+            return false;
+        task.run();
+        if (--task.tasks->pending == 0)
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+            }
+            finished.notify_all();
+        }
+        return true;
+    }
+
+    // body of a worker thread (priority PRIORITY_HIGH) or of a thread of
+    // the lane of the given priority (worker -1)
+    inline void Scheduler::work(int worker, int priority)
+    {
+        self = worker;
+        while (true)
+        {
+            if (runOne(priority))
+                continue;
+            std::unique_lock<std::mutex> guard(lock);
+            idle[priority].wait(guard, [&] { return done || queued[priority] > 0; });
+            if (done && queued[priority] <= 0)
+                return;
+        }
+    }
+
+    inline Scheduler &scheduler()
+    {
+        static Scheduler *instance =
+            new Scheduler(std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1));
+        return *instance;
+    }
+}
+
+#endif
@@ -9,17 +9,65 @@
 #include <cmath>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <atomic>
+#include <cerrno>
 #include "Drawing.h"
+#include "Tasks.h"
 
 using namespace std;
 using namespace compsys;
 
 const int W = 640;
 const int H = 480;
-const int S = 40;      // delay in milliseconds
-const int F = 200;     // number of update iterations
+const int Z = 480;     // depth of the box in 3D
+const int S = 40;      // frame period in milliseconds
+const int F = 200;     // number of frames
+const int MAX_STEPS = 64;  // maximum number of physics steps per frame
 const int DEFAULT_N = 10;  // default number of atoms for random generation
 const double PI = 3.14159265358979323846;
+const int STAMP_MAX = 6;   // atoms up to this diameter (in pixels) are drawn from stamps
+const double VECTOR_TIME = 4.0;  // velocity vectors point where the atoms are after this time
+const double TRAIL_FADE = 1.0 / 32;  // intensity left of a trail segment after trailLength frames
+const unsigned int TRAIL_COLOR = 0x7090C0;  // color of the trails
+const float SMOOTH_BOX = 3;  // smooth atoms up to this radius (in pixels) are drawn box by box (see LANES)
+const float SMOOTH_STAMP = 1;  // smooth atoms up to this radius (in pixels) are drawn from coverage stamps
+const int PHASES = 4;      // sub-pixel positions per pixel and axis of the coverage stamps (a power of 2)
+const int RADII = 8;       // radii per pixel of the coverage stamps
+const int DENSITY_N = 20000;  // from this number of atoms on, a density field is drawn
+const int CELL = 4;        // width and height of a density field cell in pixels
+const int GRAIN = 4096;    // minimum number of items per chunk of parallel loops
+const int SPLIT = 8;       // parallel loops are split into up to this many chunks per thread
+const int FIELD_BLOCK = 256;  // atoms whose positions the field loops gather at a time
+const int GRID_N = 64;     // from this number of atoms on, the grid broadphase is used
+const int TW = 160;        // width of a thumbnail
+const int TH = 120;        // height of a thumbnail
+const int SPECIES_MAX = 65536;  // maximum number of species of atoms
+const int GROUP_MAX = 256;     // maximum number of groups of species with their own pair interactions
+const int QUEUE_MAX = 64;  // maximum number of thumbnails waiting to be written
+const size_t DIRECT_ALIGN = 4096;  // alignment of the buffers and sizes of O_DIRECT writes
+const int DUMP_THREADS = 4;  // tasks of the pool writing the snapshots at the same time
+static_assert(DUMP_THREADS <= BLOCKING_THREADS[PRIORITY_LOW], "the tasks of the pool must fit into the lane of the writers");
+const double SOFTENING = 10.0;  // softening length of the central attraction
 
 
 // Random generation parameters
@@ -31,23 +79,1048 @@ const double V1 = 5.0;    // maximum speed
 // Global random engine (seeded in init)
 default_random_engine rng;
 
+// How the atoms are drawn: as discs, as anti-aliased discs at sub-pixel
+// positions, as a density field colored by the fraction of each cell covered
+// by atoms, or by the mean velocity of the atoms in each cell; RENDER_AUTO
+// draws a density field from DENSITY_N atoms on, and discs otherwise, never
+// the anti-aliased discs, which are slower and only drawn on request.
+enum RenderMode { RENDER_AUTO, RENDER_DISCS, RENDER_SMOOTH, RENDER_DENSITY, RENDER_VELOCITY };
+RenderMode renderMode = RENDER_AUTO;
+
+// Overlays of the atoms drawn as discs: the velocity vector of each atom, and
+// a trail fading over the last trailLength frames (0 for none).
+bool velocityVectors = false;
+int trailLength = 0;
+
+// The engine configuration, see dispatch(); BROADPHASE_AUTO uses the grid
+// from GRID_N atoms on.
+enum Precision { PRECISION_DOUBLE, PRECISION_FLOAT };
+enum BoundaryMode { BOUNDARY_WALLS, BOUNDARY_PERIODIC, BOUNDARY_PISTONS };
+enum BroadphaseMode { BROADPHASE_AUTO, BROADPHASE_PAIRS, BROADPHASE_GRID };
+enum CollisionMode { COLLISION_AUTO, COLLISION_ELASTIC, COLLISION_INELASTIC };
+Precision precision = PRECISION_DOUBLE;
+BoundaryMode boundaryMode = BOUNDARY_WALLS;
+BroadphaseMode broadphaseMode = BROADPHASE_AUTO;
+CollisionMode collisionMode = COLLISION_AUTO;
+
+// The walls of the box with BOUNDARY_PISTONS: the left and right walls at x0
+// and x1 and the top and bottom walls at y0 and y1 move with the prescribed
+// velocities v (in the order left, right, top, bottom) within the window,
+// each stopping at the edge of the window or where the box would become
+// narrower than gap. Each wall accumulates the momentum it takes from the
+// atoms and the time integral of its length, whose ratio is its mean pressure.
+struct Box {
+    double x0, x1, y0, y1;
+    double v[4];
+    double gap;
+    double impulse[4];
+    double exposure[4];
+};
+Box box = { 0, W, 0, H, { 0, 0, 0, 0 }, 0, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } };
+
+// Default coefficient of restitution of the atoms and coefficient of friction
+// of the inelastic collision model; COLLISION_AUTO selects the inelastic model
+// if the collisions are not perfectly elastic and frictionless by default,
+// or if any atom of the input file has a coefficient below 1 (inelasticAtoms,
+// set by number() before the model is selected)
+double restitution = 1.0;
+double friction = 0.0;
+bool inelasticAtoms = false;
+
+// External force fields acting on the atoms, as accelerations: a uniform
+// gravity (gx, gy), a central attraction of strength k towards (cx, cy) that
+// falls off with the squared distance (softened by SOFTENING), and a field
+// sampled at the centers of a grid of fw*fh cells covering the box
+struct Field {
+    bool gravity;
+    double gx, gy;
+    bool central;
+    double cx, cy, k;
+    int fw, fh;
+    vector<double> fx, fy;   // field at the center of cell (i, j) at index j*fw + i
+};
+Field field = { false, 0, 0, false, 0, 0, 0, 0, 0, {}, {} };
+
+// The short-range pair potential between the atoms (in addition to the external
+// fields), each with a cutoff at cutoff*sigma, where sigma is the sum of the
+// radii of the two atoms and the cutoff 0 selects the default of the potential:
+// - Lennard-Jones 4*epsilon*((sigma/r)^12 - (sigma/r)^6) (default cutoff 2.5),
+// - WCA, its purely repulsive part shifted by epsilon (cutoff 2^(1/6)),
+// - Yukawa epsilon*(sigma/r)*exp(-kappa*(r/sigma - 1)) (default cutoff 3).
+// Lennard-Jones and WCA replace the hard-disc collisions, while the screened
+// Yukawa repulsion acts between hard discs.
+enum PotentialMode { POTENTIAL_HARD, POTENTIAL_LJ, POTENTIAL_WCA, POTENTIAL_YUKAWA };
+PotentialMode potential = POTENTIAL_HARD;
+double epsilon = 1.0;
+double cutoff = 0;
+double kappa = 1.0;
+
+// The long-range interaction between all the atoms, with the force between two
+// atoms proportional to coupling*mi*mj/r in the plane (the masses, or the
+// charges, being proportional to the square of the radii), softened at
+// SOFTENING, and attractive for gravity or repulsive for like charges. It is
+// evaluated on a Barnes-Hut quadtree, whose cells are opened when their width
+// exceeds theta times their distance, approximated by their monopole and
+// optionally their quadrupole moments, or for a periodic box on a mesh of
+// meshSize*meshSize cells by a particle-mesh solver (without softening, and
+// with a uniform background that makes the box neutral).
+enum LongRangeMode { LONGRANGE_NONE, LONGRANGE_GRAVITY, LONGRANGE_COULOMB };
+enum SolverMode { SOLVER_TREE, SOLVER_MESH };
+LongRangeMode longRange = LONGRANGE_NONE;
+SolverMode solver = SOLVER_TREE;
+double coupling = 1.0;
+double theta = 0.5;
+bool quadrupole = false;
+int meshSize = 128;
+
+// Static obstacles in the box, read from a scene file: line segments, polygons
+// and fixed discs, which the atoms bounce off like off the walls (with their
+// coefficient of restitution). A polygon is solid: its edges are segments with
+// an outward normal, and an atom whose center got inside it is pushed out
+// across its nearest edge. The obstacles are sorted once into a grid of cells
+// of width cell, each listing the obstacles within reach of an atom whose
+// center lies in the cell.
+struct Scene {
+    vector<double> x0, y0, x1, y1;        // segments from (x0, y0) to (x1, y1)
+    vector<double> nx, ny;                // outward unit normal of a polygon edge, 0 for a segment
+    vector<double> cx, cy, cr;            // discs of radius cr around (cx, cy)
+    vector<int> first, last;              // the edges of polygon p are segments first[p]..last[p]-1
+    vector<vector<int> > polygons;        // corner coordinates x y ... of the polygons
+    int gw, gh;                           // number of columns and rows
+    double cell;                          // width and height of a cell
+    vector<int> start;                    // obstacles of cell c are items[start[c]..start[c+1]-1]
+    vector<int> items;                    // segment k, disc k - segments or polygon k - segments - discs
+};
+Scene scene = { {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, 0, 0, 0, {}, {} };
+
+// The species of the atoms: each atom only stores the index of its species,
+// which holds its density (mass per unit area, or per unit volume in 3D) and
+// its coefficient of restitution. A pair of species s and t has the
+// coefficient of restitution of their collisions (by default the smaller of
+// the two) and the energy scale epsilon of their pair potential (by default
+// the one of the options). A species file sets these by the color of the
+// atoms, but the species are only the distinct physical properties of the
+// initial atoms: the colors are kept per atom (see atomColors), so that any
+// number of colors makes no more species.
+struct Species {
+    double density;
+    double restitution;
+    int group;     // row and column of the species in the table of the pairs
+};
+struct SpeciesColor {
+    unsigned int color;
+    double density;
+    double restitution;
+};
+struct Interaction {
+    double restitution;
+    double epsilon;
+};
+struct SpeciesPair {
+    unsigned int color1, color2;
+    Interaction interaction;
+};
+vector<Species> species;
+vector<Interaction> interactions;        // of the groups g and h at index g*groupCount + h
+int groupCount = 0;
+vector<SpeciesColor> speciesFile;        // the species as given in the species file, by color
+vector<SpeciesPair> speciesPairs;        // the pairs as given in the species file
+
+// The number of dimensions of the box (2 or 3); a 3D run draws the projection of
+// the spheres onto the xy plane, and supports the elastic collisions only
+int dimensions = 2;
+
+// The time step (0 = as many steps per frame as the frame period allows); a
+// frame lasts one time unit, so 1/timeStep is a whole number of steps
+double timeStep = 0;
+
+// Whether to run without a window (and without pacing the frames)
+bool headless = false;
+
+// Every how many frames a thumbnail is written (0 = never), and the file
+// name, into which the frame number is inserted before the extension
+int thumbEvery = 0;
+string thumbFile = "atoms.png";
+
+// Every how many frames a quantized binary snapshot of the atoms is written
+// (0 = never), and the file name, into which the frame number is inserted
+// before the extension (see SnapshotHeader)
+int snapshotEvery = 0;
+string snapshotFile = "atoms.atq";
+
+// The snapshots can instead all be appended to one trajectory file. They are
+// written in the background from dumpBuffers buffers, in the given mode and
+// optionally with O_DIRECT (see Dumper).
+enum DumpMode { DUMP_WRITE, DUMP_WRITEV, DUMP_URING, DUMP_POOL };
+string trajectoryFile;
+DumpMode dumpMode = DUMP_WRITE;
+bool dumpDirect = false;
+int dumpBuffers = 2;
+
+// The atoms are stored in the precision Real chosen at startup (float or double),
+// as discs (D = 2) or as spheres (D = 3). An atom only holds the attributes that
+// every step reads and writes; the attributes that the steps only read at
+// contacts, and the drawing and the output per atom, are kept in cold arrays
+// at the same index, so the loops over the atoms stream the hot bytes only.
+template <class Real, int D = 2>
 struct Atom {
-    int color;
-    double r;   // radius
-    double x, y;  // center position
-    double vx, vy; // velocity components
+    Real r;   // radius
+    Real x, y;  // center position
+    Real vx, vy; // velocity components
+};
+
+template <class Real>
+struct Atom<Real, 3> {
+    Real r;   // radius
+    Real x, y, z;  // center position
+    Real vx, vy, vz; // velocity components
+};
+
+// The depth of an atom and its velocity, which are 0 for a disc
+template <class Real>
+inline Real depthOf(const Atom<Real>&) {
+    return 0;
+}
+
+template <class Real>
+inline Real depthOf(const Atom<Real, 3>& atom) {
+    return atom.z;
+}
+
+// The cold attributes of the atoms: the species of atom i is atomSpecies[i]
+// and its color (24-bit RGB, as given) is atomColors[i]
+vector<uint16_t> atomSpecies;
+vector<unsigned int> atomColors;
+bool unitDensity = true;     // whether all the species have the density 1
+
+inline const Species& speciesOf(int i) {
+    return species[atomSpecies[i]];
+}
+
+// The density of atom i, looked up only if the species differ in density
+inline double densityOf(int i) {
+    return unitDensity ? 1.0 : speciesOf(i).density;
+}
+
+// The interaction of the species of atoms i and j
+inline const Interaction& interactionOf(int i, int j) {
+    return interactions[speciesOf(i).group * groupCount + speciesOf(j).group];
+}
+
+// The mass of atom i, its area or volume times the density of its species
+template <class Real>
+inline double massOf(const Atom<Real>& atom, int i) {
+    return double(atom.r) * atom.r * densityOf(i);
+}
+
+template <class Real>
+inline double massOf(const Atom<Real, 3>& atom, int i) {
+    return double(atom.r) * atom.r * atom.r * densityOf(i);
+}
+
+template <class Real>
+inline Real depthVelocityOf(const Atom<Real>&) {
+    return 0;
+}
+
+template <class Real>
+inline Real depthVelocityOf(const Atom<Real, 3>& atom) {
+    return atom.vz;
+}
+
+template <class Real>
+inline void setDepth(Atom<Real>&, double, double) {
+}
+
+template <class Real>
+inline void setDepth(Atom<Real, 3>& atom, double z, double vz) {
+    atom.z = static_cast<Real>(z);
+    atom.vz = static_cast<Real>(vz);
+}
+
+//
+// parallelFor: Runs body over the range 0..n-1 on the threads of the scheduler,
+// the calling thread included, in one of two ways:
+// - body(begin, end, worker) is called once for each of workers(n) contiguous
+//   slots of at least GRAIN items, where worker numbers the slots from 0 on;
+//   a body can thus accumulate into buffers of its slot, and as the slots
+//   do not depend on which thread runs them, neither does the result.
+// - body(begin, end) is called for chunks sized automatically: the range is
+//   halved, the upper half left for idle threads to steal, until the chunks
+//   have n/(SPLIT*threads) items, but at least GRAIN; so the threads that are
+//   free take more of the chunks.
+//
+int workers(int n) {
+    return max(1, min(scheduler().getThreads(), (n + GRAIN - 1) / GRAIN));
+}
+
+template <class Body>
+auto parallelFor(int n, Body body) -> decltype(body(0, 0, 0), void()) {
+    int t = workers(n);
+    if (t == 1) {
+        body(0, n, 0);
+        return;
+    }
+    Tasks tasks;
+    for (int w = 1; w < t; w++)
+        scheduler().spawn(tasks, PRIORITY_HIGH, [&body, n, t, w] {
+            body(static_cast<int>(long(n) * w / t), static_cast<int>(long(n) * (w + 1) / t), w);
+        });
+    body(0, n / t, 0);
+    scheduler().wait(tasks);
+}
+
+template <class Body>
+void splitRange(Tasks& tasks, int begin, int end, int grain, Body& body) {
+    while (end - begin > grain) {
+        int middle = begin + (end - begin) / 2;
+        scheduler().spawn(tasks, PRIORITY_HIGH, [&tasks, middle, end, grain, &body] {
+            splitRange(tasks, middle, end, grain, body);
+        });
+        end = middle;
+    }
+    body(begin, end);
+}
+
+template <class Body>
+auto parallelFor(int n, Body body) -> decltype(body(0, 0), void()) {
+    int threads = scheduler().getThreads();
+    if (threads == 1 || n <= GRAIN) {
+        body(0, n);
+        return;
+    }
+    Tasks tasks;
+    splitRange(tasks, 0, n, max(GRAIN, n / (SPLIT * threads)), body);
+    scheduler().wait(tasks);
+}
+
+//
+// loadField: Reads the field sampled on a grid from the given file, which holds
+// the numbers fw and fh of columns and rows of the grid, followed by the field
+// components x y at the center of each cell, row by row from the top.
+//
+void loadField(const char* filename) {
+    ifstream infile(filename);
+    if (!infile) {
+        cerr << "Error: Cannot open file " << filename << endl;
+        exit(1);
+    }
+    infile >> field.fw >> field.fh;
+    if (!infile || field.fw <= 0 || field.fh <= 0) {
+        cerr << "Error: Invalid field size in file " << filename << endl;
+        exit(1);
+    }
+    field.fx.resize(field.fw * field.fh);
+    field.fy.resize(field.fw * field.fh);
+    for (int c = 0; c < field.fw * field.fh; c++) {
+        infile >> field.fx[c] >> field.fy[c];
+        if (!infile) {
+            cerr << "Error: File format incorrect for field cell " << c << endl;
+            exit(1);
+        }
+    }
+}
+
+//
+// loadScene: Reads the obstacles from the given file, which holds one obstacle
+// per line (empty lines and lines starting with # are skipped):
+//   segment X0 Y0 X1 Y1
+//   polygon K X1 Y1 ... XK YK
+//   disc X Y R
+//
+void loadScene(const char* filename) {
+    ifstream infile(filename);
+    if (!infile) {
+        cerr << "Error: Cannot open file " << filename << endl;
+        exit(1);
+    }
+    string line;
+    for (int number = 1; getline(infile, line); number++) {
+        istringstream values(line);
+        string kind;
+        if (!(values >> kind) || kind[0] == '#')
+            continue;
+        bool valid = false;
+        if (kind == "segment") {
+            double x0, y0, x1, y1;
+            if (values >> x0 >> y0 >> x1 >> y1) {
+                scene.x0.push_back(x0);
+                scene.y0.push_back(y0);
+                scene.x1.push_back(x1);
+                scene.y1.push_back(y1);
+                scene.nx.push_back(0);
+                scene.ny.push_back(0);
+                valid = true;
+            }
+        }
+        else if (kind == "polygon") {
+            int k = 0;
+            values >> k;
+            vector<double> xs(max(k, 0)), ys(max(k, 0));
+            for (int i = 0; i < k; i++)
+                values >> xs[i] >> ys[i];
+            if (values && k >= 2) {
+                // the sign of the area gives the side of the outward normals;
+                // a polygon without area only has its edges as segments
+                double area = 0;
+                for (int i = 0; i < k; i++)
+                    area += xs[i] * ys[(i + 1) % k] - xs[(i + 1) % k] * ys[i];
+                double side = area > 0 ? 1 : area < 0 ? -1 : 0;
+                if (side != 0)
+                    scene.first.push_back(static_cast<int>(scene.x0.size()));
+                vector<int> corners;
+                for (int i = 0; i < k; i++) {
+                    int j = (i + 1) % k;
+                    double length = hypot(xs[j] - xs[i], ys[j] - ys[i]);
+                    scene.x0.push_back(xs[i]);
+                    scene.y0.push_back(ys[i]);
+                    scene.x1.push_back(xs[j]);
+                    scene.y1.push_back(ys[j]);
+                    scene.nx.push_back(length > 0 ? side * (ys[j] - ys[i]) / length : 0);
+                    scene.ny.push_back(length > 0 ? side * (xs[i] - xs[j]) / length : 0);
+                    corners.push_back(static_cast<int>(lround(xs[i])));
+                    corners.push_back(static_cast<int>(lround(ys[i])));
+                }
+                if (side != 0)
+                    scene.last.push_back(static_cast<int>(scene.x0.size()));
+                scene.polygons.push_back(corners);
+                valid = true;
+            }
+        }
+        else if (kind == "disc") {
+            double x, y, r;
+            if (values >> x >> y >> r && r > 0) {
+                scene.cx.push_back(x);
+                scene.cy.push_back(y);
+                scene.cr.push_back(r);
+                valid = true;
+            }
+        }
+        if (!valid) {
+            cerr << "Error: Scene format incorrect in line " << number << " of " << filename << endl;
+            exit(1);
+        }
+    }
+}
+
+//
+// loadSpecies: Reads the properties of the species from the given file, one
+// species or pair of species per line (empty lines and lines starting with #
+// are skipped), each selected by the color of its atoms:
+//   species COLOR DENSITY RESTITUTION
+//   pair COLOR1 COLOR2 RESTITUTION EPSILON
+//
+void loadSpecies(const char* filename) {
+    ifstream infile(filename);
+    if (!infile) {
+        cerr << "Error: Cannot open file " << filename << endl;
+        exit(1);
+    }
+    string line;
+    for (int number = 1; getline(infile, line); number++) {
+        istringstream values(line);
+        string kind;
+        if (!(values >> kind) || kind[0] == '#')
+            continue;
+        bool valid = false;
+        if (kind == "species") {
+            SpeciesColor kindOf;
+            if (values >> kindOf.color >> kindOf.density >> kindOf.restitution
+                && kindOf.density > 0 && kindOf.restitution >= 0 && kindOf.restitution <= 1) {
+                speciesFile.push_back(kindOf);
+                valid = true;
+            }
+        }
+        else if (kind == "pair") {
+            SpeciesPair pair;
+            if (values >> pair.color1 >> pair.color2 >> pair.interaction.restitution >> pair.interaction.epsilon
+                && pair.interaction.restitution >= 0 && pair.interaction.restitution <= 1) {
+                speciesPairs.push_back(pair);
+                valid = true;
+            }
+        }
+        if (!valid) {
+            cerr << "Error: Species format incorrect in line " << number << " of " << filename << endl;
+            exit(1);
+        }
+    }
+}
+
+//
+// inelasticSpecies: Whether the species file makes any collisions inelastic.
+//
+bool inelasticSpecies() {
+    for (const SpeciesColor& given : speciesFile)
+        if (given.restitution < 1)
+            return true;
+    for (const SpeciesPair& pair : speciesPairs)
+        if (pair.interaction.restitution < 1)
+            return true;
+    return false;
+}
+
+//
+// startSpecies: Keeps the colors of the atoms, and assigns each atom the
+// species of its density, coefficient of restitution and group, the ones of
+// the species file for its color if given. The pairs are tabulated by the
+// groups of the species, the species of a group sharing their coefficient of
+// restitution and, if it is named in a pair of the species file, the color of
+// their atoms, so that the table stays small however many colors there are.
+//
+void startSpecies(int n, const vector<unsigned int>& colors, const vector<double>& restitutions) {
+    atomColors = colors;
+    unordered_map<unsigned int, const SpeciesColor*> given;
+    for (const SpeciesColor& kind : speciesFile)
+        given[kind.color] = &kind;
+    unordered_map<unsigned int, bool> named;
+    for (const SpeciesPair& pair : speciesPairs)
+        named[pair.color1] = named[pair.color2] = true;
+
+    // the species, each with the color named in a pair, if any, of its group
+    species.clear();
+    atomSpecies.assign(n, 0);
+    vector<unsigned int> tags;
+    map<tuple<double, double, unsigned int>, int> index;
+    for (int i = 0; i < n; i++) {
+        auto kind = given.find(colors[i]);
+        double density = kind != given.end() ? kind->second->density : 1.0;
+        double e = kind != given.end() ? kind->second->restitution : restitutions[i];
+        unsigned int tag = named.count(colors[i]) ? colors[i] : 0xFFFFFFFFu;
+        auto found = index.insert({ make_tuple(density, e, tag), static_cast<int>(species.size()) }).first;
+        if (found->second == static_cast<int>(species.size())) {
+            if (found->second == SPECIES_MAX) {
+                cerr << "Error: More than " << SPECIES_MAX << " species of atoms" << endl;
+                exit(1);
+            }
+            species.push_back({ density, e, 0 });
+            tags.push_back(tag);
+        }
+        atomSpecies[i] = static_cast<uint16_t>(found->second);
+    }
+
+    unitDensity = true;
+    for (const Species& kind : species)
+        unitDensity = unitDensity && kind.density == 1.0;
+
+    // group the species, and tabulate the pairs of groups
+    vector<pair<double, unsigned int> > groups;   // the key of each group
+    map<pair<double, unsigned int>, int> groupOf;
+    for (size_t k = 0; k < species.size(); k++) {
+        pair<double, unsigned int> key(species[k].restitution, tags[k]);
+        auto found = groupOf.insert({ key, static_cast<int>(groups.size()) }).first;
+        if (found->second == static_cast<int>(groups.size()))
+            groups.push_back(key);
+        species[k].group = found->second;
+    }
+    size_t g = groups.size();
+    if (g > static_cast<size_t>(GROUP_MAX)) {
+        cerr << "Error: More than " << GROUP_MAX << " groups of species of atoms" << endl;
+        exit(1);
+    }
+    interactions.assign(g * g, { 1.0, epsilon });
+    for (size_t a = 0; a < g; a++)
+        for (size_t b = 0; b < g; b++)
+            interactions[a * g + b].restitution = min(groups[a].first, groups[b].first);
+    for (const SpeciesPair& pair : speciesPairs) {
+        for (size_t a = 0; a < g; a++) {
+            for (size_t b = 0; b < g; b++) {
+                unsigned int ca = groups[a].second, cb = groups[b].second;
+                if ((ca == pair.color1 && cb == pair.color2) || (ca == pair.color2 && cb == pair.color1))
+                    interactions[a * g + b] = pair.interaction;
+            }
+        }
+    }
+    groupCount = static_cast<int>(g);
+}
+
+//
+// startScene: Sorts the obstacles into the grid of the scene. An obstacle is
+// listed in every cell with a point closer to it than the given reach (the
+// largest radius of the atoms), so an atom only needs to be tested against the
+// obstacles of the cell holding its center: O(1) tests per atom, in place of
+// O(m) for m obstacles. A polygon is listed in the cells that overlap its
+// bounding box, for the test whether the center is inside it.
+//
+void startScene(double reach) {
+    int segments = static_cast<int>(scene.x0.size());
+    int discs = static_cast<int>(scene.cx.size());
+    int m = segments + discs;
+    if (m == 0)
+        return;
+    scene.cell = max(1.0, sqrt(double(W) * H / m));
+    scene.gw = max(1, static_cast<int>(ceil(W / scene.cell)));
+    scene.gh = max(1, static_cast<int>(ceil(H / scene.cell)));
+    const double half = scene.cell * sqrt(0.5);   // distance from the center to a corner of a cell
+
+    vector<vector<int> > lists(scene.gw * scene.gh);
+    for (int k = 0; k < m; k++) {
+        double x0, y0, x1, y1, r;
+        if (k < segments) {
+            x0 = scene.x0[k];
+            y0 = scene.y0[k];
+            x1 = scene.x1[k];
+            y1 = scene.y1[k];
+            r = 0;
+        }
+        else {
+            x0 = x1 = scene.cx[k - segments];
+            y0 = y1 = scene.cy[k - segments];
+            r = scene.cr[k - segments];
+        }
+        double d = r + reach + half;
+        int i0 = max(0, static_cast<int>(floor((min(x0, x1) - d) / scene.cell)));
+        int i1 = min(scene.gw - 1, static_cast<int>(floor((max(x0, x1) + d) / scene.cell)));
+        int j0 = max(0, static_cast<int>(floor((min(y0, y1) - d) / scene.cell)));
+        int j1 = min(scene.gh - 1, static_cast<int>(floor((max(y0, y1) + d) / scene.cell)));
+        double ex = x1 - x0, ey = y1 - y0, e2 = ex * ex + ey * ey;
+        for (int j = j0; j <= j1; j++) {
+            for (int i = i0; i <= i1; i++) {
+                double px = (i + 0.5) * scene.cell - x0, py = (j + 0.5) * scene.cell - y0;
+                double t = e2 > 0 ? min(max((px * ex + py * ey) / e2, 0.0), 1.0) : 0;
+                if (hypot(px - t * ex, py - t * ey) <= d)
+                    lists[j * scene.gw + i].push_back(k);
+            }
+        }
+    }
+    for (size_t p = 0; p < scene.first.size(); p++) {
+        double x0 = W, y0 = H, x1 = 0, y1 = 0;
+        for (int k = scene.first[p]; k < scene.last[p]; k++) {
+            x0 = min(x0, scene.x0[k]);
+            y0 = min(y0, scene.y0[k]);
+            x1 = max(x1, scene.x0[k]);
+            y1 = max(y1, scene.y0[k]);
+        }
+        int i0 = max(0, static_cast<int>(floor(x0 / scene.cell)));
+        int i1 = min(scene.gw - 1, static_cast<int>(floor(x1 / scene.cell)));
+        int j0 = max(0, static_cast<int>(floor(y0 / scene.cell)));
+        int j1 = min(scene.gh - 1, static_cast<int>(floor(y1 / scene.cell)));
+        for (int j = j0; j <= j1; j++)
+            for (int i = i0; i <= i1; i++)
+                lists[j * scene.gw + i].push_back(m + static_cast<int>(p));
+    }
+    scene.start.assign(1, 0);
+    scene.items.clear();
+    for (const vector<int>& list : lists) {
+        scene.items.insert(scene.items.end(), list.begin(), list.end());
+        scene.start.push_back(static_cast<int>(scene.items.size()));
+    }
+}
+
+//
+// options: Processes the options given before the file name and removes them
+// from argv, so that afterwards argc and argv only hold the program name and
+// the optional file name. Supported options:
+//   -render=auto|discs|smooth|density|velocity   how the atoms are drawn
+//                     (smooth: anti-aliased discs, slower, never chosen by auto)
+//   -vectors          draw the velocity vectors of the atoms drawn as discs
+//   -trails=K         draw trails of the last K frames behind the atoms drawn as discs
+//   -precision=double|float        precision of the atoms
+//   -boundary=walls|periodic|pistons   boundary of the box
+//   -pistons=VL,VR,VT,VB  velocities of the left, right, top and bottom walls
+//                     (selects -boundary=pistons)
+//   -broadphase=auto|pairs|grid    how candidate pairs of atoms are found
+//   -collision=auto|elastic|inelastic   how collisions are resolved
+//   -restitution=E    default coefficient of restitution (0..1) of the atoms
+//   -friction=MU      coefficient of friction (>= 0) of inelastic collisions
+//   -gravity=GX,GY    uniform gravity
+//   -central=X,Y,K    central attraction of strength K towards X,Y
+//   -field=FILE       field sampled on a grid, read from FILE (see loadField)
+//   -potential=hard|lj|wca|yukawa  short-range pair potential
+//   -epsilon=E        energy scale of the pair potential
+//   -cutoff=C         cutoff of the pair potential in units of sigma
+//   -kappa=K          screening of the Yukawa potential in units of 1/sigma
+//   -longrange=none|gravity|coulomb  long-range interaction between all atoms
+//   -coupling=K       strength of the long-range interaction
+//   -theta=T          opening angle of the Barnes-Hut tree
+//   -quadrupole       quadrupole moments in the Barnes-Hut tree
+//   -solver=tree|mesh solver of the long-range interaction
+//   -mesh=N           cells per side of the mesh (a power of 2)
+//   -scene=FILE       static obstacles, read from FILE (see loadScene)
+//   -species=FILE     densities and restitution of the species of atoms and
+//                     of their pairs, read from FILE (see loadSpecies)
+//   -dim=2|3          discs in a rectangle or spheres in a box
+//   -dt=DT            fixed time step, where 1/DT is a whole number of steps
+//                     per frame (a frame lasts one time unit), no coarser
+//                     than the largest stable time step of a potential
+//   -headless         run without a window, as fast as possible
+//   -thumbs=K         write a thumbnail every K frames (K >= 1)
+//   -thumbfile=NAME   file name of the thumbnails (.png or .ppm)
+//   -snapshots=K      write a quantized binary snapshot every K frames (K >= 1)
+//   -snapfile=NAME    file name of the snapshots
+//   -trajectory=NAME  append all the snapshots to one file instead
+//   -snapio=write|writev|uring|pool   how the snapshots are written
+//   -snapdirect       write the snapshots with O_DIRECT
+//   -snapbuffers=K    number of snapshots that can wait to be written
+//
+void options(int& argc, const char* argv[]) {
+    int k = 1;
+    while (k < argc && argv[k][0] == '-') {
+        string option = argv[k];
+        if (option == "-precision=double") precision = PRECISION_DOUBLE;
+        else if (option == "-precision=float") precision = PRECISION_FLOAT;
+        else if (option == "-boundary=walls") boundaryMode = BOUNDARY_WALLS;
+        else if (option == "-boundary=periodic") boundaryMode = BOUNDARY_PERIODIC;
+        else if (option == "-boundary=pistons") boundaryMode = BOUNDARY_PISTONS;
+        else if (option.compare(0, 9, "-pistons=") == 0) {
+            boundaryMode = BOUNDARY_PISTONS;
+            if (sscanf(option.c_str() + 9, "%lf,%lf,%lf,%lf", &box.v[0], &box.v[1], &box.v[2], &box.v[3]) != 4) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option == "-broadphase=auto") broadphaseMode = BROADPHASE_AUTO;
+        else if (option == "-broadphase=pairs") broadphaseMode = BROADPHASE_PAIRS;
+        else if (option == "-broadphase=grid") broadphaseMode = BROADPHASE_GRID;
+        else if (option == "-collision=auto") collisionMode = COLLISION_AUTO;
+        else if (option == "-collision=elastic") collisionMode = COLLISION_ELASTIC;
+        else if (option == "-collision=inelastic") collisionMode = COLLISION_INELASTIC;
+        else if (option.compare(0, 13, "-restitution=") == 0) {
+            restitution = atof(option.c_str() + 13);
+            if (restitution < 0 || restitution > 1) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 10, "-friction=") == 0) {
+            friction = atof(option.c_str() + 10);
+            if (friction < 0) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 9, "-gravity=") == 0) {
+            field.gravity = sscanf(option.c_str() + 9, "%lf,%lf", &field.gx, &field.gy) == 2;
+            if (!field.gravity) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 9, "-central=") == 0) {
+            field.central = sscanf(option.c_str() + 9, "%lf,%lf,%lf", &field.cx, &field.cy, &field.k) == 3;
+            if (!field.central) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 7, "-field=") == 0) loadField(option.c_str() + 7);
+        else if (option == "-potential=hard") potential = POTENTIAL_HARD;
+        else if (option == "-potential=lj") potential = POTENTIAL_LJ;
+        else if (option == "-potential=wca") potential = POTENTIAL_WCA;
+        else if (option == "-potential=yukawa") potential = POTENTIAL_YUKAWA;
+        else if (option.compare(0, 9, "-epsilon=") == 0) epsilon = atof(option.c_str() + 9);
+        else if (option.compare(0, 8, "-cutoff=") == 0) cutoff = atof(option.c_str() + 8);
+        else if (option.compare(0, 7, "-kappa=") == 0) kappa = atof(option.c_str() + 7);
+        else if (option == "-longrange=none") longRange = LONGRANGE_NONE;
+        else if (option == "-longrange=gravity") longRange = LONGRANGE_GRAVITY;
+        else if (option == "-longrange=coulomb") longRange = LONGRANGE_COULOMB;
+        else if (option.compare(0, 10, "-coupling=") == 0) coupling = atof(option.c_str() + 10);
+        else if (option.compare(0, 7, "-theta=") == 0) theta = atof(option.c_str() + 7);
+        else if (option == "-quadrupole") quadrupole = true;
+        else if (option == "-solver=tree") solver = SOLVER_TREE;
+        else if (option == "-solver=mesh") solver = SOLVER_MESH;
+        else if (option.compare(0, 6, "-mesh=") == 0) {
+            meshSize = atoi(option.c_str() + 6);
+            if (meshSize < 2 || (meshSize & (meshSize - 1)) != 0) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 7, "-scene=") == 0) loadScene(option.c_str() + 7);
+        else if (option.compare(0, 9, "-species=") == 0) loadSpecies(option.c_str() + 9);
+        else if (option == "-dim=2") dimensions = 2;
+        else if (option == "-dim=3") dimensions = 3;
+        else if (option.compare(0, 4, "-dt=") == 0) {
+            timeStep = atof(option.c_str() + 4);
+            // a frame must be a whole number of steps (up to the digits given)
+            double steps = timeStep > 0 ? 1 / timeStep : 0;
+            if (timeStep <= 0 || timeStep > 1 || fabs(steps - round(steps)) > 1e-5 * steps) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option == "-headless") headless = true;
+        else if (option.compare(0, 8, "-thumbs=") == 0) {
+            thumbEvery = atoi(option.c_str() + 8);
+            if (thumbEvery < 1) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 11, "-thumbfile=") == 0) thumbFile = option.substr(11);
+        else if (option.compare(0, 11, "-snapshots=") == 0) {
+            snapshotEvery = atoi(option.c_str() + 11);
+            if (snapshotEvery < 1) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option.compare(0, 10, "-snapfile=") == 0) snapshotFile = option.substr(10);
+        else if (option.compare(0, 12, "-trajectory=") == 0) trajectoryFile = option.substr(12);
+        else if (option == "-snapio=write") dumpMode = DUMP_WRITE;
+        else if (option == "-snapio=writev") dumpMode = DUMP_WRITEV;
+        else if (option == "-snapio=uring") dumpMode = DUMP_URING;
+        else if (option == "-snapio=pool") dumpMode = DUMP_POOL;
+        else if (option == "-snapdirect") dumpDirect = true;
+        else if (option.compare(0, 13, "-snapbuffers=") == 0) {
+            dumpBuffers = atoi(option.c_str() + 13);
+            if (dumpBuffers < 1 || dumpBuffers > 1024) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option == "-render=auto") renderMode = RENDER_AUTO;
+        else if (option == "-render=discs") renderMode = RENDER_DISCS;
+        else if (option == "-render=smooth") renderMode = RENDER_SMOOTH;
+        else if (option == "-vectors") velocityVectors = true;
+        else if (option.compare(0, 8, "-trails=") == 0) {
+            trailLength = atoi(option.c_str() + 8);
+            if (trailLength < 2) {
+                cerr << "Error: Invalid option " << option << endl;
+                exit(1);
+            }
+        }
+        else if (option == "-render=density") renderMode = RENDER_DENSITY;
+        else if (option == "-render=velocity") renderMode = RENDER_VELOCITY;
+        else {
+            cerr << "Error: Unknown option " << option << endl;
+            exit(1);
+        }
+        k++;
+    }
+    bool planar = field.gravity || field.central || field.fw > 0 || potential != POTENTIAL_HARD
+        || longRange != LONGRANGE_NONE || collisionMode == COLLISION_INELASTIC
+        || restitution < 1 || friction > 0 || inelasticSpecies() || !scene.x0.empty() || !scene.cx.empty();
+    if (dimensions == 3 && planar) {
+        cerr << "Error: Force stages, inelastic collisions and obstacles require -dim=2" << endl;
+        exit(1);
+    }
+    if (longRange != LONGRANGE_NONE && solver == SOLVER_MESH && boundaryMode != BOUNDARY_PERIODIC) {
+        cerr << "Error: The mesh solver requires -boundary=periodic" << endl;
+        exit(1);
+    }
+    for (int i = k; i < argc; i++)
+        argv[i - k + 1] = argv[i];
+    argc -= k - 1;
+}
+
+//
+// SnapshotHeader: A quantized binary snapshot of the atoms, which is written
+// every snapshotEvery frames and can be read in place of an atom file. After
+// the header, the snapshot holds each field of all the atoms in turn: the
+// 24-bit colors as 3 bytes (red, green, blue) padded to a multiple of 4 bytes,
+// then the radii, the positions
+// and the velocity components as 16-bit integers q, each standing for the
+// value lo + q*step of its field. The positions are fixed-point offsets within
+// the box, and the other fields are quantized against their actual range, so
+// a field is off by at most step/2, and a color not at all. All numbers are
+// in the byte order of the machine. A trajectory file holds the snapshots one
+// right after the other, each sizeof(SnapshotHeader) + snapshotBytes() long,
+// whatever way it was written.
+//
+const int FIELDS = 7;    // r, x, y, z, vx, vy, vz, of which a disc has no z and vz
+const char SNAPSHOT_MAGIC[4] = { 'A', 'T', 'Q', '2' };
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t n;              // number of atoms
+    uint32_t dimensions;     // 2 or 3
+    uint32_t fields;         // number of quantized fields stored
+    uint32_t frame;          // number of the frame (0 before the first)
+    uint32_t unused;         // 0, aligns the doubles
+    double lo[FIELDS];
+    double step[FIELDS];
 };
 
+// An atom is an array of its fields in the order above, so field f of atom i
+// is the Real at i*sizeof(Atom)/sizeof(Real) + offsetOf(f, D) of the atoms.
+static_assert(sizeof(Atom<double>) == 5 * sizeof(double), "atoms must be arrays of their fields");
+static_assert(sizeof(Atom<float, 3>) == 7 * sizeof(float), "atoms must be arrays of their fields");
+
+inline int offsetOf(int field, int dimensions) {
+    static const int planar[FIELDS] = { 0, 1, 2, -1, 3, 4, -1 };
+    return dimensions == 3 ? field : planar[field];
+}
+
+// The size of the colors and of all the fields of n atoms
+inline size_t colorBytes(int n) {
+    return (3 * static_cast<size_t>(n) + 3) & ~static_cast<size_t>(3);
+}
+
+inline size_t snapshotBytes(int n, int dimensions) {
+    return colorBytes(n) + 2 * static_cast<size_t>(n) * (dimensions == 3 ? 7 : 5);
+}
+
+//
+// isSnapshot: Whether the given file is a snapshot.
+//
+bool isSnapshot(const char* filename) {
+    ifstream infile(filename, ios::binary);
+    char magic[4];
+    return infile.read(magic, 4) && memcmp(magic, SNAPSHOT_MAGIC, 4) == 0;
+}
+
+//
+// quantize, dequantize: Convert count values, which are Stride Reals apart,
+// to and from 16-bit integers q, standing for base + q/scale, or base + q*step.
+// The loops are free of branches and vectorize (-O3), loading and storing the
+// values with a constant stride.
+//
+template <int Stride, class Real>
+void quantize(int count, const Real* __restrict values, Real base, Real scale, uint16_t* __restrict q) {
+    for (int i = 0; i < count; i++) {
+        Real v = (values[static_cast<size_t>(i) * Stride] - base) * scale + Real(0.5);
+        q[i] = static_cast<uint16_t>(min(max(v, Real(0)), Real(65535)));
+    }
+}
+
+template <int Stride, class Real>
+void dequantize(int count, const uint16_t* __restrict q, Real base, Real step, Real* __restrict values) {
+    for (int i = 0; i < count; i++)
+        values[static_cast<size_t>(i) * Stride] = base + Real(q[i]) * step;
+}
+
+//
+// encodeSnapshot: Quantizes the atoms into the header and the snapshotBytes(n, D)
+// bytes of a snapshot, one field after the other, each in parallel over the
+// atoms.
+//
+template <class Real, int D>
+void encodeSnapshot(int n, const Atom<Real, D> atoms[], SnapshotHeader& header, unsigned char* bytes) {
+    const int stride = sizeof(Atom<Real, D>) / sizeof(Real);
+    const Real* values = reinterpret_cast<const Real*>(atoms);
+    const double extent[3] = { double(W), double(H), double(Z) };
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.n = n;
+    header.dimensions = D;
+    header.fields = D == 3 ? 7 : 5;
+    header.frame = header.unused = 0;
+
+    const unsigned int* given = atomColors.data();
+    unsigned char* colors = bytes;
+    memset(colors + 3 * static_cast<size_t>(n), 0, colorBytes(n) - 3 * static_cast<size_t>(n));
+    parallelFor(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            unsigned int color = given[i];
+            colors[3 * i] = static_cast<unsigned char>(color >> 16);
+            colors[3 * i + 1] = static_cast<unsigned char>(color >> 8);
+            colors[3 * i + 2] = static_cast<unsigned char>(color);
+        }
+    });
+
+    uint16_t* q = reinterpret_cast<uint16_t*>(bytes + colorBytes(n));
+    for (int f = 0; f < FIELDS; f++) {
+        header.lo[f] = header.step[f] = 0;
+        const int offset = offsetOf(f, D);
+        if (offset < 0)
+            continue;
+        const Real* field = values + offset;
+        double lo = 0, hi = 0;
+        if (f >= 1 && f <= 3) {
+            hi = extent[f - 1];
+        }
+        else if (n > 0) {
+            Real a = field[0], b = field[0];
+            for (int i = 1; i < n; i++) {
+                a = min(a, field[static_cast<size_t>(i) * stride]);
+                b = max(b, field[static_cast<size_t>(i) * stride]);
+            }
+            lo = a;
+            hi = b;
+        }
+        header.lo[f] = lo;
+        header.step[f] = (hi - lo) / 65535;
+        const Real base = static_cast<Real>(lo);
+        const Real scale = static_cast<Real>(hi > lo ? 65535 / (hi - lo) : 0);
+        parallelFor(n, [&](int begin, int end) {
+            quantize<sizeof(Atom<Real, D>) / sizeof(Real)>(end - begin, field + static_cast<size_t>(begin) * stride,
+                                                          base, scale, q + begin);
+        });
+        q += n;
+    }
+}
+
+//
+// decodeSnapshot: Sets the atoms and their colors from the header and the
+// bytes of a snapshot.
+//
+template <class Real, int D>
+void decodeSnapshot(const SnapshotHeader& header, const vector<unsigned char>& bytes, Atom<Real, D> atoms[],
+    vector<unsigned int>& colors) {
+    const int n = header.n;
+    const int stride = sizeof(Atom<Real, D>) / sizeof(Real);
+    Real* values = reinterpret_cast<Real*>(atoms);
+    const unsigned char* rgb = bytes.data();
+    for (int i = 0; i < n; i++)
+        colors[i] = (unsigned int)rgb[3 * i] << 16 | (unsigned int)rgb[3 * i + 1] << 8 | rgb[3 * i + 2];
+
+    const uint16_t* q = reinterpret_cast<const uint16_t*>(bytes.data() + colorBytes(n));
+    for (int f = 0; f < FIELDS; f++) {
+        const int offset = offsetOf(f, D);
+        if (offset < 0)
+            continue;
+        Real* field = values + offset;
+        const Real base = static_cast<Real>(header.lo[f]);
+        const Real step = static_cast<Real>(header.step[f]);
+        parallelFor(n, [&](int begin, int end) {
+            dequantize<sizeof(Atom<Real, D>) / sizeof(Real)>(end - begin, q + begin, base, step,
+                                                            field + static_cast<size_t>(begin) * stride);
+        });
+        q += n;
+    }
+}
+
+//
+// loadSnapshot: Reads the atoms and their colors from a snapshot file; the
+// number of atoms comes from its header, as read by number().
+//
+template <class Real, int D>
+void loadSnapshot(const char* filename, int n, Atom<Real, D> atoms[], vector<unsigned int>& colors) {
+    ifstream infile(filename, ios::binary);
+    SnapshotHeader header;
+    if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)) || static_cast<int>(header.n) != n) {
+        cerr << "Error: Snapshot format incorrect in " << filename << endl;
+        exit(1);
+    }
+    if (static_cast<int>(header.dimensions) != D) {
+        cerr << "Error: Snapshot " << filename << " holds atoms of " << header.dimensions
+            << " dimensions, use -dim=" << header.dimensions << endl;
+        exit(1);
+    }
+    if (header.fields != (D == 3 ? 7u : 5u)) {
+        cerr << "Error: Snapshot format incorrect in " << filename << endl;
+        exit(1);
+    }
+    vector<unsigned char> bytes(snapshotBytes(n, D));
+    if (!infile.read(reinterpret_cast<char*>(bytes.data()), bytes.size())) {
+        cerr << "Error: Snapshot " << filename << " is truncated" << endl;
+        exit(1);
+    }
+    decodeSnapshot(header, bytes, atoms, colors);
+}
+
 //
 // number: Determines the number of atoms.
 // If no file is given (argc==1), returns DEFAULT_N.
-// If a file is provided (argc==2), reads the first number from the file.
+// If a file is provided (argc==2), reads the first number from the file, or
+// the number in the header of a snapshot. The atoms of the file are scanned
+// for a coefficient of restitution below 1 (see init()), which selects the
+// inelastic collision model.
 //
 int number(int argc, const char* argv[]) {
     int n = 0;
     if (argc == 1) {
         n = DEFAULT_N;
     }
+    else if (argc == 2 && isSnapshot(argv[1])) {
+        ifstream infile(argv[1], ios::binary);
+        SnapshotHeader header;
+        if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.n == 0
+            || header.n > 0x7FFFFFFFu) {
+            cerr << "Error: Invalid number of atoms in snapshot" << endl;
+            exit(1);
+        }
+        n = static_cast<int>(header.n);
+    }
     else if (argc == 2) {
         ifstream infile(argv[1]);
         if (!infile) {
@@ -59,6 +1132,21 @@ int number(int argc, const char* argv[]) {
             cerr << "Error: Invalid number of atoms in file" << endl;
             exit(1);
         }
+        // the coefficient follows the 6 (discs) or 8 (spheres) values of an atom
+        const int values = dimensions == 3 ? 8 : 6;
+        string line;
+        while (!inelasticAtoms && getline(infile, line)) {
+            istringstream atom(line);
+            double value, e;
+            int k = 0;
+            while (k < values && atom >> value)
+                k++;
+            inelasticAtoms = k == values && atom >> e && e < 1;
+        }
+        if (inelasticAtoms && dimensions == 3) {
+            cerr << "Error: Inelastic collisions require -dim=2" << endl;
+            exit(1);
+        }
     }
     // Print the number of atoms
     cout << n << endl;
@@ -70,9 +1158,16 @@ int number(int argc, const char* argv[]) {
 // For random initialization, it generates atoms with random radius,
 // position (fully contained in the window and not overlapping with already placed atoms),
 // speed and direction, and a random color.
-// For file input, it reads the atom values from the given file.
+// For file input, it reads the atom values from the given file, one atom per line;
+// an optional seventh value on a line gives the coefficient of restitution (0..1) of the atom.
+// Unless given in the file, the coefficient of restitution is the one of the options.
+// A snapshot (see SnapshotHeader) is read in place of an atom file.
+// The atoms of the same color and coefficient of restitution form a species.
 //
-void init(int n, Atom atoms[], int argc, const char* argv[]) {
+template <class Real, int D>
+void init(int n, Atom<Real, D> atoms[], int argc, const char* argv[]) {
+    vector<unsigned int> colors(n);
+    vector<double> restitutions(n, restitution);
     if (argc == 1) {
         // Seed random generator nondeterministically
         random_device rand_dev;
@@ -81,6 +1176,7 @@ void init(int n, Atom atoms[], int argc, const char* argv[]) {
         uniform_real_distribution<double> radius_dist(R0, R1);
         uniform_real_distribution<double> speed_dist(V0, V1);
         uniform_real_distribution<double> angle_dist(0, 2 * PI);
+        uniform_real_distribution<double> cos_dist(-1, 1);
         // For color: generate an RGB color in the range 0x000000 to 0xFFFFFF
         uniform_int_distribution<int> color_dist(0, 0xFFFFFF);
 
@@ -92,15 +1188,18 @@ void init(int n, Atom atoms[], int argc, const char* argv[]) {
                 // Ensure the atom is completely inside the window
                 uniform_real_distribution<double> pos_x_dist(r, W - r);
                 uniform_real_distribution<double> pos_y_dist(r, H - r);
+                uniform_real_distribution<double> pos_z_dist(r, Z - r);
                 double x = pos_x_dist(rng);
                 double y = pos_y_dist(rng);
+                double z = D == 3 ? pos_z_dist(rng) : 0;
 
                 // Check for intersection with already placed atoms
                 bool intersect = false;
                 for (int j = 0; j < i; j++) {
                     double dx = atoms[j].x - x;
                     double dy = atoms[j].y - y;
-                    double dist = sqrt(dx * dx + dy * dy);
+                    double dz = depthOf(atoms[j]) - z;
+                    double dist = sqrt(dx * dx + dy * dy + dz * dz);
                     if (dist < atoms[j].r + r) {
                         intersect = true;
                         break;
@@ -112,9 +1211,13 @@ void init(int n, Atom atoms[], int argc, const char* argv[]) {
                     atoms[i].y = y;
                     double speed = speed_dist(rng);
                     double angle = angle_dist(rng);
-                    atoms[i].vx = speed * cos(angle);
-                    atoms[i].vy = speed * sin(angle);
-                    atoms[i].color = color_dist(rng);
+                    // a direction uniform on the sphere in 3D
+                    double c = D == 3 ? cos_dist(rng) : 0;
+                    double s = D == 3 ? sqrt(1 - c * c) : 1;
+                    atoms[i].vx = speed * s * cos(angle);
+                    atoms[i].vy = speed * s * sin(angle);
+                    setDepth(atoms[i], z, speed * c);
+                    colors[i] = color_dist(rng);
                     placed = true;
                 }
                 attempts++;
@@ -126,6 +1229,9 @@ void init(int n, Atom atoms[], int argc, const char* argv[]) {
             }
         }
     }
+    else if (argc == 2 && isSnapshot(argv[1])) {
+        loadSnapshot(argv[1], n, atoms, colors);
+    }
     else if (argc == 2) {
         ifstream infile(argv[1]);
         if (!infile) {
@@ -134,179 +1240,3236 @@ void init(int n, Atom atoms[], int argc, const char* argv[]) {
         }
         int file_n;
         infile >> file_n;
+        string line;
+        getline(infile, line);
         for (int i = 0; i < n; i++) {
+            while (getline(infile, line) && line.find_first_not_of(" \t\r") == string::npos)
+                ;
+            istringstream values(line);
             int color;
-            double r, x, y, vx, vy;
-            infile >> color >> r >> x >> y >> vx >> vy;
-            if (!infile) {
+            double r, x, y, z = 0, vx, vy, vz = 0;
+            // spheres have the columns color r x y z vx vy vz
+            values >> color >> r >> x >> y;
+            if (D == 3)
+                values >> z;
+            values >> vx >> vy;
+            if (D == 3)
+                values >> vz;
+            if (!infile || !values) {
                 cerr << "Error: File format incorrect for atom " << i << endl;
                 exit(1);
             }
-            atoms[i].color = color;
+            double e = restitution;
+            if (!(values >> e))
+                e = restitution;
+            else if (e < 0 || e > 1) {
+                cerr << "Error: Coefficient of restitution out of 0..1 for atom " << i << endl;
+                exit(1);
+            }
+            colors[i] = static_cast<unsigned int>(color);
+            restitutions[i] = e;
             atoms[i].r = r;
             atoms[i].x = x;
             atoms[i].y = y;
             atoms[i].vx = vx;
             atoms[i].vy = vy;
+            setDepth(atoms[i], z, vz);
         }
     }
-    // Print the initial atom values (one per line)
+    startSpecies(n, colors, restitutions);
+    // Print the initial atom values (one per line), flushing once at the end
     for (int i = 0; i < n; i++) {
-        cout << atoms[i].color << " "
+        cout << atomColors[i] << " "
             << atoms[i].r << " "
             << atoms[i].x << " "
-            << atoms[i].y << " "
-            << atoms[i].vx << " "
-            << atoms[i].vy << endl;
+            << atoms[i].y << " ";
+        if (D == 3)
+            cout << depthOf(atoms[i]) << " ";
+        cout << atoms[i].vx << " "
+            << atoms[i].vy;
+        if (D == 3)
+            cout << " " << depthVelocityOf(atoms[i]);
+        cout << '\n';
     }
+    cout.flush();
 }
 
 //
-// draw: Clears the window and draws each atom as a filled circle.
-// Note: The drawing functions work with the top-left corner of the bounding rectangle,
-// so we convert (center, radius) to (x-top, y-top) and width/height.
+// Stamp: Precomputed pixel spans of a filled disc with a small diameter d;
+// row j < rows of the disc covers the pixels x0[j]..x1[j] relative to its
+// bounding box. Like fillEllipse(), which draws a disc of radius d/2 around
+// the pixel d/2 of the box, the disc covers 2*(d/2)+1 rows and columns (d+1
+// for an even d).
 //
-void draw(int n, Atom atoms[]) {
-    // Clear screen by drawing a white rectangle covering the window
-    fillRectangle(0, 0, W, H, 0xFFFFFF, NO_COLOR);
+struct Stamp {
+    int rows;
+    int x0[STAMP_MAX + 1];
+    int x1[STAMP_MAX + 1];
+};
+Stamp stamps[STAMP_MAX + 1];
 
-    for (int i = 0; i < n; i++) {
-        int x_top = static_cast<int>(atoms[i].x - atoms[i].r);
-        int y_top = static_cast<int>(atoms[i].y - atoms[i].r);
-        int diameter = static_cast<int>(2 * atoms[i].r);
-        fillEllipse(x_top, y_top, diameter, diameter, atoms[i].color, NO_COLOR);
+//
+// initStamps: Computes the stamps of all diameters 2..STAMP_MAX from discs
+// drawn by fillEllipse() on an off-screen surface, so that the stamps cover
+// exactly the pixels that fillEllipse() does.
+//
+void initStamps() {
+    for (int d = 2; d <= STAMP_MAX; d++) {
+        Surface surface(STAMP_MAX + 1, STAMP_MAX + 1);
+        surface.fillEllipse(0, 0, d, d, 0);
+        Framebuffer fb = surface.beginAccess();
+        stamps[d].rows = 0;
+        for (int j = 0; j < fb.height; j++) {
+            const unsigned char* row = fb.pixels + j * fb.stride;
+            int x0 = 0, x1 = fb.width - 1;
+            while (x0 < fb.width && row[x0 * fb.pixelStride] != 0)
+                x0++;
+            while (x1 >= x0 && row[x1 * fb.pixelStride] != 0)
+                x1--;
+            if (x0 > x1)
+                break;
+            stamps[d].x0[j] = x0;
+            stamps[d].x1[j] = x1;
+            stamps[d].rows = j + 1;
+        }
+        surface.endAccess();
     }
-    flush();
 }
 
 //
-// update: Updates the position of each atom, handles collisions with the window
-// boundaries and then detects and resolves collisions between atoms.
-// For boundary collisions, if an atom’s center is closer to a wall than its radius,
-// the atom is repositioned and the corresponding velocity component is inverted.
-// For atom–atom collisions, if two atoms overlap, we reposition one of them so that they
-// just touch and then update the velocity components along the collision axis (using an
-// elastic collision model with masses proportional to the square of the radii).
+// wordOf: The pixel word of color in a framebuffer of words.
 //
-void update(int n, Atom atoms[]) {
-    // Update positions and wall collisions
-    for (int i = 0; i < n; i++) {
-        atoms[i].x += atoms[i].vx;
-        atoms[i].y += atoms[i].vy;
+unsigned int wordOf(const Framebuffer& fb, unsigned int color) {
+    unsigned int word = 0;
+    for (int c = 0; c < fb.channels; c++)
+        word |= ((color >> (16 - 8 * c)) & 0xFF) << fb.shifts[c];
+    return word;
+}
 
-        // Left wall
-        if (atoms[i].x - atoms[i].r <= 0) {
-            atoms[i].x = atoms[i].r;
-            atoms[i].vx = -atoms[i].vx;
-        }
-        // Right wall
-        if (atoms[i].x + atoms[i].r >= W) {
-            atoms[i].x = W - atoms[i].r;
-            atoms[i].vx = -atoms[i].vx;
-        }
-        // Top wall
-        if (atoms[i].y - atoms[i].r <= 0) {
-            atoms[i].y = atoms[i].r;
-            atoms[i].vy = -atoms[i].vy;
+//
+// putSpan: Sets the pixels x0..x1 of row y of the framebuffer to color,
+// clipped to the dimensions of the framebuffer; whole words at a time if the
+// pixels are words.
+//
+void putSpan(const Framebuffer& fb, int x0, int x1, int y, unsigned int color) {
+    if (y < 0 || y >= fb.height)
+        return;
+    x0 = max(x0, 0);
+    x1 = min(x1, fb.width - 1);
+    if (x0 > x1)
+        return;
+    if (fb.words) {
+        fill_n(fb.words + y * (fb.stride / 4) + x0, x1 - x0 + 1, wordOf(fb, color));
+        return;
+    }
+    for (int c = 0; c < fb.channels; c++) {
+        unsigned char v = (color >> (16 - 8 * c)) & 0xFF;
+        unsigned char* p = fb.pixels + y * fb.stride + x0 * fb.pixelStride + c * fb.channelStride;
+        if (fb.pixelStride == 1) {
+            memset(p, v, x1 - x0 + 1);
         }
-        // Bottom wall
-        if (atoms[i].y + atoms[i].r >= H) {
-            atoms[i].y = H - atoms[i].r;
-            atoms[i].vy = -atoms[i].vy;
+        else {
+            for (int x = x0; x <= x1; x++, p += fb.pixelStride)
+                *p = v;
         }
     }
+}
 
-    // Check collisions between atoms (for each pair i < j)
-    for (int i = 0; i < n; i++) {
-        for (int j = i + 1; j < n; j++) {
-            double dx = atoms[j].x - atoms[i].x;
-            double dy = atoms[j].y - atoms[i].y;
-            double dist = sqrt(dx * dx + dy * dy);
-            double sumR = atoms[i].r + atoms[j].r;
-            if (dist < sumR) {
-                // Reposition atom j so that the two atoms just touch
-                double overlap = sumR - dist;
-                double norm = (dist == 0) ? 1.0 : dist;
-                atoms[j].x += (dx / norm) * overlap;
-                atoms[j].y += (dy / norm) * overlap;
-
-                // --- Collision resolution using elastic collision theory ---
-                // Compute tangent vector (perpendicular to line joining centers)
-                double tx = -dy;
-                double ty = dx;
-                double a = atan2(ty, tx);  // angle of the tangent
-
-                // Get polar coordinates of velocities
-                double vi_speed = sqrt(atoms[i].vx * atoms[i].vx + atoms[i].vy * atoms[i].vy);
-                double vj_speed = sqrt(atoms[j].vx * atoms[j].vx + atoms[j].vy * atoms[j].vy);
-                double vi_angle = atan2(atoms[i].vy, atoms[i].vx);
-                double vj_angle = atan2(atoms[j].vy, atoms[j].vx);
-
-                // Rotate velocities so that the tangent is horizontal
-                double vi_rot_angle = vi_angle - a;
-                double vj_rot_angle = vj_angle - a;
-
-                // Decompose velocities in the rotated coordinate system
-                double vi_horiz = vi_speed * cos(vi_rot_angle);
-                double vi_vert = vi_speed * sin(vi_rot_angle);
-                double vj_horiz = vj_speed * cos(vj_rot_angle);
-                double vj_vert = vj_speed * sin(vj_rot_angle);
-
-                // Masses proportional to the square of the radii
-                double m1 = atoms[i].r * atoms[i].r;
-                double m2 = atoms[j].r * atoms[j].r;
-                // Compute center-of-mass velocity along the collision axis (vertical component)
-                double V_center = (m1 * vi_vert + m2 * vj_vert) / (m1 + m2);
-                // Compute new vertical velocities after collision (elastic collision)
-                double vi_vert_new = 2 * V_center - vi_vert;
-                double vj_vert_new = 2 * V_center - vj_vert;
-
-                // Recombine with unchanged horizontal components
-                double vi_rot_speed_new = sqrt(vi_horiz * vi_horiz + vi_vert_new * vi_vert_new);
-                double vj_rot_speed_new = sqrt(vj_horiz * vj_horiz + vj_vert_new * vj_vert_new);
-                double vi_rot_angle_new = atan2(vi_vert_new, vi_horiz);
-                double vj_rot_angle_new = atan2(vj_vert_new, vj_horiz);
-
-                // Rotate velocities back to original coordinate system
-                double vi_final_angle = vi_rot_angle_new + a;
-                double vj_final_angle = vj_rot_angle_new + a;
-                atoms[i].vx = vi_rot_speed_new * cos(vi_final_angle);
-                atoms[i].vy = vi_rot_speed_new * sin(vi_final_angle);
-                atoms[j].vx = vj_rot_speed_new * cos(vj_final_angle);
-                atoms[j].vy = vj_rot_speed_new * sin(vj_final_angle);
-            }
-        }
-    }
-}
-
-
-//
-// main: Creates the drawing window, initializes the atoms (either randomly or from file),
-// draws the initial state, waits for the user to press Enter, then performs F update iterations
-// with a delay of S milliseconds between each frame. Finally, it cleans up and waits until the
-// user closes the window.
 //
-int main(int argc, const char* argv[])
-{
-    beginDrawing(W, H, "Atoms", 0xFFFFFF, false);
-    int n = number(argc, argv);
-    Atom* atoms = new Atom[n];
+// Lanes: The floats processed by one instruction, eight in an AVX register
+// and four in an SSE register; WordLanes and HalfLanes hold as many pixel
+// words, as words or as 16 bit halves.
+//
+#ifdef __AVX__
+const int LANES = 8;
+#else
+const int LANES = 4;
+#endif
+typedef float Lanes __attribute__((vector_size(LANES * sizeof(float))));
+typedef int WordLanes __attribute__((vector_size(LANES * sizeof(int))));
+typedef unsigned short HalfLanes __attribute__((vector_size(LANES * sizeof(int))));
+
+//
+// cover: Computes the fraction a[k] of the pixel k (0 <= k < LANES) of a row
+// covered by a disc of radius r (in pixels), given the horizontal offset dx
+// of the center of pixel 0 and the squared vertical offset dy2 of the row
+// from the center of the disc.
+// Near the edge, the distance d of a pixel center from the center of the disc
+// is about r + (d*d - r*r) / (2r), so the coverage 1/2 + r - d becomes
+// 1/2 + (r*r - d*d) / (2r), clamped to 0..1, without any square root; over
+// the plane, it adds up to the area of the disc.
+//
+inline void cover(float dx, float dy2, float r, Lanes& a) {
+    const Lanes zero = { }, one = zero + 1;
+    Lanes offsets = zero;
+    for (int k = 0; k < LANES; k++)
+        offsets[k] = k;
+    const float inv = 1 / (2 * r);
+    Lanes x = offsets + dx;
+    a = (0.5f + (r * r - dy2) * inv) - x * x * inv;
+    a = a < zero ? zero : a;
+    a = a > one ? one : a;
+}
+
+//
+// coverage: Like cover() for the count pixels of alpha, LANES at a time;
+// alpha must have room for count rounded up to a multiple of LANES.
+//
+void coverage(int count, float dx, float dy2, float r, float* __restrict alpha) {
+    for (int k = 0; k < count; k += LANES) {
+        Lanes a;
+        cover(dx + k, dy2, r, a);
+        memcpy(alpha + k, &a, sizeof(a));
+    }
+}
+
+//
+// blend: Blends the pixel word fg over bg with weight a (0..256), a byte at a
+// time, regardless of the position of the color components in the word; a
+// weight of 0 keeps bg and one of 256 gives fg.
+//
+inline unsigned int blend(unsigned int bg, unsigned int fg, unsigned int a) {
+    unsigned int rb = ((bg & 0x00FF00FF) * (256 - a) + (fg & 0x00FF00FF) * a) >> 8;
+    unsigned int ga = ((bg >> 8) & 0x00FF00FF) * (256 - a) + ((fg >> 8) & 0x00FF00FF) * a;
+    return (rb & 0x00FF00FF) | (ga & 0xFF00FF00);
+}
+
+//
+// blendLanes: Blends the word fg over the LANES pixels from p on with the
+// weights alpha, all at once. Like blend(), but the bytes spread over 16 bit
+// halves are multiplied as halves, twice as many per instruction as words;
+// weightOf() gives the weights (0..256) in both halves of each word.
+//
+inline void blendLanes(unsigned int* p, unsigned int fg, const HalfLanes& weight) {
+    HalfLanes rest = 256 - weight;
+    const WordLanes zero = { };
+    const HalfLanes frontRB = reinterpret_cast<HalfLanes>(zero + static_cast<int>(fg & 0x00FF00FF));
+    const HalfLanes frontGA = reinterpret_cast<HalfLanes>(zero + static_cast<int>((fg >> 8) & 0x00FF00FF));
+    WordLanes bg;
+    memcpy(&bg, p, sizeof(bg));
+    HalfLanes rb = reinterpret_cast<HalfLanes>(bg & 0x00FF00FF) * rest + frontRB * weight;
+    HalfLanes ga = reinterpret_cast<HalfLanes>((bg >> 8) & 0x00FF00FF) * rest + frontGA * weight;
+    bg = (reinterpret_cast<WordLanes>(rb >> 8) & 0x00FF00FF) | (reinterpret_cast<WordLanes>(ga) & 0xFF00FF00);
+    memcpy(p, &bg, sizeof(bg));
+}
+
+inline HalfLanes weightOf(const Lanes& alpha) {
+    WordLanes a = __builtin_convertvector(alpha * 256 + 0.5f, WordLanes);
+    return reinterpret_cast<HalfLanes>(a | (a << 16));
+}
+
+inline void blendLanes(unsigned int* p, unsigned int fg, const Lanes& alpha) {
+    blendLanes(p, fg, weightOf(alpha));
+}
+
+//
+// blendSpan: Blends the word fg over the pixels x0..x1 of a row with the
+// weights alpha[0..x1-x0], skipping those outside 0..width-1.
+//
+void blendSpan(unsigned int* row, int width, int x0, int x1, unsigned int fg, const float* alpha) {
+    for (int x = max(x0, 0); x <= min(x1, width - 1); x++) {
+        unsigned int a = static_cast<unsigned int>(alpha[x - x0] * 256 + 0.5f);
+        if (a >= 256)
+            row[x] = fg;
+        else if (a > 0)
+            row[x] = blend(row[x], fg, a);
+    }
+}
+
+//
+// floorOf: The largest integer not greater than x, without a call of floor().
+//
+inline int floorOf(float x) {
+    int i = static_cast<int>(x);
+    return i - (x < i);
+}
+
+//
+// Coverage: The precomputed weights of a smooth disc of radius 0.5 up to
+// SMOOTH_STAMP pixels (in steps of 1/RADII) whose center lies at one of
+// PHASES*PHASES sub-pixel positions of a pixel: row j of the box of the disc
+// is the LANES pixels from (x0, y0 + j) on, relative to the pixel, with the
+// weights of blendLanes(). The pixels touched are closer than sqrt(r*r + r)
+// (see drawSmoothDiscs()), less than 2*sqrt(2) pixels across, so the box has
+// SMOOTH_SIDE rows of which the last may have zero weights, and every disc is
+// blended in the same steps, without branches.
+//
+const int SMOOTH_SIDE = 3;
+static_assert(SMOOTH_SIDE <= LANES, "a row of a coverage stamp must fit into LANES pixels");
+// the phase of a position in units of 1/PHASES pixels is its lowest PHASE_BITS bits
+constexpr int bitsOf(int n) { return n > 1 ? 1 + bitsOf(n / 2) : 0; }
+const int PHASE_BITS = bitsOf(PHASES);
+static_assert(1 << PHASE_BITS == PHASES, "PHASES must be a power of 2");
+struct Coverage {
+    int x0, y0;
+    HalfLanes weight[SMOOTH_SIDE];
+};
+// of radius 0.5 + k/RADII and phase px, py at (k*PHASES + py)*PHASES + px
+vector<Coverage> coverages;
+
+//
+// initCoverages: Computes the coverage stamps with cover(), so that they
+// weigh the pixels like the larger discs drawn row by row.
+//
+void initCoverages() {
+    const int radii = static_cast<int>((SMOOTH_STAMP - 0.5f) * RADII) + 1;
+    coverages.resize(static_cast<size_t>(radii) * PHASES * PHASES);
+    for (int k = 0; k < radii; k++) {
+        for (int p = 0; p < PHASES * PHASES; p++) {
+            Coverage& stamp = coverages[static_cast<size_t>(k) * PHASES * PHASES + p];
+            const float r = 0.5f + static_cast<float>(k) / RADII;
+            const float cx = static_cast<float>(p % PHASES) / PHASES;
+            const float cy = static_cast<float>(p / PHASES) / PHASES;
+            const float reach = sqrt(r * r + r);
+            stamp.x0 = -floorOf(reach + 0.5f - cx);
+            stamp.y0 = -floorOf(reach + 0.5f - cy);
+            for (int j = 0; j < SMOOTH_SIDE; j++) {
+                float dy = stamp.y0 + j + 0.5f - cy;
+                Lanes a;
+                cover(stamp.x0 + 0.5f - cx, dy * dy, r, a);
+                stamp.weight[j] = weightOf(a);
+            }
+        }
+    }
+}
+
+//
+// Trails: The positions of the atoms in the last trailLength frames, in a ring
+// buffer of frames, and the trails drawn from them on surfaces of the sizes
+// drawn so far (the window and the thumbnails). The trail of a surface is an
+// off-screen buffer of intensities that fade by the factor decay per frame;
+// it holds the frames recorded up to drawn, and when it is drawn again, the
+// segments of the frames recorded since then are added. As the trail of a
+// pixel is the maximum of the intensities of the segments through it, the
+// new segments are added divided by the fading since then, and the whole
+// buffer fades while it is composited into the framebuffer, in one pass of
+// LANES pixels at a time; intensities too faint to show are set to 0 there
+// (rather than fading on into denormals, which are slow). Only the columns
+// first[y] to last[y] of row y may hold intensities (none if first[y] >
+// last[y]), so only those are faded and composited, and the rest of the row
+// is filled with white.
+//
+struct Glow {
+    int width, height;
+    long drawn;
+    vector<float> values;
+    vector<int> first, last;
+};
+
+struct Trails {
+    long frames;            // number of frames recorded
+    vector<float> xs, ys;   // position of atom i in frame f at (f % trailLength) * n + i
+    double decay;
+    vector<Glow> glows;
+};
+
+Trails trails;
+
+//
+// recordTrails: Records the positions of the atoms in the current frame.
+//
+template <class Real, int D>
+void recordTrails(int n, Atom<Real, D> atoms[]) {
+    if (trailLength == 0)
+        return;
+    if (trails.xs.empty()) {
+        trails.xs.resize(static_cast<size_t>(trailLength) * n);
+        trails.ys.resize(static_cast<size_t>(trailLength) * n);
+        trails.decay = pow(TRAIL_FADE, 1.0 / trailLength);
+    }
+    size_t slot = static_cast<size_t>(trails.frames % trailLength) * n;
+    for (int i = 0; i < n; i++) {
+        trails.xs[slot + i] = static_cast<float>(atoms[i].x);
+        trails.ys[slot + i] = static_cast<float>(atoms[i].y);
+    }
+    trails.frames++;
+}
+
+//
+// depositSegment: Raises the intensities along the segment from x0,y0 to
+// x1,y1 (in pixels) to at least w.
+//
+void depositSegment(Glow& glow, float x0, float y0, float x1, float y1, float w) {
+    int steps = static_cast<int>(max(fabs(x1 - x0), fabs(y1 - y0))) + 1;
+    float sx = (x1 - x0) / steps, sy = (y1 - y0) / steps;
+    for (int k = 0; k <= steps; k++, x0 += sx, y0 += sy) {
+        int x = static_cast<int>(x0), y = static_cast<int>(y0);
+        if (x0 >= 0 && y0 >= 0 && x < glow.width && y < glow.height) {
+            float& v = glow.values[static_cast<size_t>(y) * glow.width + x];
+            v = max(v, w);
+            glow.first[y] = min(glow.first[y], x);
+            glow.last[y] = max(glow.last[y], x);
+        }
+    }
+}
+
+//
+// drawBackground: Clears the framebuffer to white, with the trails of the atoms
+// over it if there are any. The segments recorded since the trail of the
+// surface was last drawn are added (skipping those across a periodic boundary),
+// then the trail is composited into the framebuffer while it fades.
+//
+void drawBackground(const Framebuffer& fb, int n, double scale) {
+    if (trailLength == 0 || trails.frames == 0) {
+        for (int y = 0; y < fb.height; y++)
+            putSpan(fb, 0, fb.width - 1, y, 0xFFFFFF);
+        return;
+    }
+    Glow* glow = nullptr;
+    for (Glow& g : trails.glows)
+        if (g.width == fb.width && g.height == fb.height)
+            glow = &g;
+    if (!glow) {
+        trails.glows.push_back(Glow{ fb.width, fb.height, 0, vector<float>(static_cast<size_t>(fb.width) * fb.height),
+                                     vector<int>(fb.height, fb.width), vector<int>(fb.height, -1) });
+        glow = &trails.glows.back();
+    }
+
+    long steps = trails.frames - glow->drawn;
+    if (steps >= trailLength) {
+        for (int y = 0; y < fb.height; y++) {
+            if (glow->first[y] <= glow->last[y])
+                fill_n(&glow->values[static_cast<size_t>(y) * fb.width + glow->first[y]],
+                       glow->last[y] - glow->first[y] + 1, 0.0f);
+            glow->first[y] = fb.width;
+            glow->last[y] = -1;
+        }
+        steps = trailLength;
+    }
+    const float fade = static_cast<float>(pow(trails.decay, static_cast<double>(steps)));
+    const float s = static_cast<float>(scale);
+    // the segment of age a ends in frame frames - 1 - a
+    for (long a = 0; a < steps && a + 1 < min(trails.frames, static_cast<long>(trailLength)); a++) {
+        const float* x1 = &trails.xs[static_cast<size_t>((trails.frames - 1 - a) % trailLength) * n];
+        const float* y1 = &trails.ys[static_cast<size_t>((trails.frames - 1 - a) % trailLength) * n];
+        const float* x0 = &trails.xs[static_cast<size_t>((trails.frames - 2 - a) % trailLength) * n];
+        const float* y0 = &trails.ys[static_cast<size_t>((trails.frames - 2 - a) % trailLength) * n];
+        const float w = static_cast<float>(pow(trails.decay, static_cast<double>(a))) / fade;
+        for (int i = 0; i < n; i++)
+            if (fabs(x1[i] - x0[i]) < W / 2 && fabs(y1[i] - y0[i]) < H / 2)
+                depositSegment(*glow, x0[i] * s, y0[i] * s, x1[i] * s, y1[i] * s, w);
+    }
+    glow->drawn = trails.frames;
+
+    for (int y = 0; y < fb.height; y++) {
+        float* values = &glow->values[static_cast<size_t>(y) * fb.width];
+        int& first = glow->first[y];
+        int& last = glow->last[y];
+        if (first > last) {
+            putSpan(fb, 0, fb.width - 1, y, 0xFFFFFF);
+            continue;
+        }
+        putSpan(fb, 0, first - 1, y, 0xFFFFFF);
+        putSpan(fb, last + 1, fb.width - 1, y, 0xFFFFFF);
+        if (fb.words) {
+            const unsigned int white = wordOf(fb, 0xFFFFFF), trail = wordOf(fb, TRAIL_COLOR);
+            const Lanes zero = { }, one = zero + 1, faint = zero + 1.0f / 512;
+            const WordLanes background = reinterpret_cast<WordLanes>(zero) + static_cast<int>(white);
+            unsigned int* row = fb.words + y * (fb.stride / 4);
+            int x = first;
+            for (; x + LANES <= last + 1; x += LANES) {
+                Lanes v;
+                memcpy(&v, values + x, sizeof(v));
+                v *= fade;
+                v = v < faint ? zero : v;
+                memcpy(values + x, &v, sizeof(v));
+                memcpy(row + x, &background, sizeof(background));
+                blendLanes(row + x, trail, v > one ? one : v);
+            }
+            for (; x <= last; x++) {
+                float v = values[x] * fade;
+                values[x] = v < 1.0f / 512 ? 0.0f : v;
+                row[x] = blend(white, trail, static_cast<unsigned int>(min(v, 1.0f) * 256 + 0.5f));
+            }
+        }
+        else {
+            for (int x = first; x <= last; x++) {
+                float v = values[x] * fade;
+                values[x] = v < 1.0f / 512 ? 0.0f : v;
+                v = min(v, 1.0f);
+                unsigned int color = 0;
+                for (int c = 0; c < 3; c++) {
+                    int from = 0xFF, to = (TRAIL_COLOR >> (16 - 8 * c)) & 0xFF;
+                    color = (color << 8) | static_cast<unsigned int>(from + v * (to - from));
+                }
+                putSpan(fb, x, x, y, color);
+            }
+        }
+        // shrink the span to the intensities left after fading
+        while (first <= last && values[first] == 0)
+            first++;
+        while (last >= first && values[last] == 0)
+            last--;
+        if (first > last) {
+            first = fb.width;
+            last = -1;
+        }
+    }
+}
+
+//
+// drawVector: Draws the velocity vector of an atom, from its center at x,y to
+// where it is after VECTOR_TIME (all in pixels), in black.
+//
+void drawVector(const Framebuffer& fb, float x, float y, float vx, float vy) {
+    float x1 = x + vx * static_cast<float>(VECTOR_TIME), y1 = y + vy * static_cast<float>(VECTOR_TIME);
+    int steps = static_cast<int>(max(fabs(x1 - x), fabs(y1 - y))) + 1;
+    float sx = (x1 - x) / steps, sy = (y1 - y) / steps;
+    for (int k = 0; k <= steps; k++, x += sx, y += sy) {
+        if (x < 0 || y < 0 || x >= fb.width || y >= fb.height)
+            continue;
+        if (fb.words)
+            fb.words[static_cast<int>(y) * (fb.stride / 4) + static_cast<int>(x)] = wordOf(fb, 0);
+        else
+            putSpan(fb, static_cast<int>(x), static_cast<int>(x), static_cast<int>(y), 0);
+    }
+}
+
+//
+// drawVectors: Draws the velocity vectors of the atoms, if requested, over
+// the atoms already drawn on the surface, scaled from the W*H box to the
+// dimensions of the surface.
+//
+template <class Real, int D>
+void drawVectors(Surface& surface, int n, Atom<Real, D> atoms[], double scale) {
+    if (!velocityVectors)
+        return;
+    Framebuffer fb = surface.beginAccess();
+    for (int i = 0; i < n; i++)
+        drawVector(fb, static_cast<float>(atoms[i].x * scale), static_cast<float>(atoms[i].y * scale),
+                   static_cast<float>(atoms[i].vx * scale), static_cast<float>(atoms[i].vy * scale));
+    surface.endAccess();
+}
+
+//
+// drawDiscs: Clears the surface and draws each atom as a filled circle, scaled
+// from the W*H box to the dimensions of the surface.
+// Note: The drawing functions work with the top-left corner of the bounding rectangle,
+// so we convert (center, radius) to (x-top, y-top) and width/height.
+// Atoms are drawn at a level of detail that depends on their size on screen:
+// sub-pixel atoms as single points and atoms up to STAMP_MAX pixels wide as
+// precomputed stamps of horizontal spans, both written directly into the
+// framebuffer; afterwards, the larger atoms are drawn by the general ellipse
+// rasterizer. The trails, if any, are drawn with the background, and the
+// velocity vectors last, over all the atoms.
+//
+template <class Real, int D>
+void drawDiscs(Surface& surface, int n, Atom<Real, D> atoms[]) {
+    double scale = min(double(surface.getWidth()) / W, double(surface.getHeight()) / H);
+    const unsigned int* colors = atomColors.data();
+    Framebuffer fb = surface.beginAccess();
+    // Clear screen to white, with the trails
+    drawBackground(fb, n, scale);
+
+    for (int i = 0; i < n; i++) {
+        int x_top = static_cast<int>((atoms[i].x - atoms[i].r) * scale);
+        int y_top = static_cast<int>((atoms[i].y - atoms[i].r) * scale);
+        int diameter = static_cast<int>(2 * atoms[i].r * scale);
+        if (diameter <= 1) {
+            int x = static_cast<int>(atoms[i].x * scale);
+            putSpan(fb, x, x, static_cast<int>(atoms[i].y * scale), colors[i]);
+        }
+        else if (diameter <= STAMP_MAX) {
+            const Stamp& stamp = stamps[diameter];
+            for (int j = 0; j < stamp.rows; j++)
+                putSpan(fb, x_top + stamp.x0[j], x_top + stamp.x1[j], y_top + j, colors[i]);
+        }
+    }
+    surface.endAccess();
+
+    for (int i = 0; i < n; i++) {
+        int diameter = static_cast<int>(2 * atoms[i].r * scale);
+        if (diameter > STAMP_MAX) {
+            int x_top = static_cast<int>((atoms[i].x - atoms[i].r) * scale);
+            int y_top = static_cast<int>((atoms[i].y - atoms[i].r) * scale);
+            surface.fillEllipse(x_top, y_top, diameter, diameter, colors[i], NO_COLOR);
+        }
+    }
+    drawVectors(surface, n, atoms, scale);
+}
+
+//
+// drawSmoothDiscs: Clears the surface and draws each atom as an anti-aliased
+// disc at its exact (sub-pixel) position and radius, scaled from the W*H box
+// to the dimensions of the surface. Each row of a disc is a span of fully
+// covered pixels, filled with whole words, between two edges whose coverage
+// is computed LANES pixels at a time and blended into the background; for
+// discs up to SMOOTH_BOX pixels in radius, whose rows fit into LANES pixels,
+// the coverage of each row of the bounding box is computed at once instead,
+// and discs up to SMOOTH_STAMP pixels in radius are blended from the coverage
+// stamp of the nearest radius and sub-pixel position.
+// Atoms less than a pixel wide are splatted onto the four nearest pixels
+// with their area as the weight. Being slower than drawDiscs() (about three
+// times for atoms of a pixel), the smooth discs are only drawn with
+// -render=smooth, never by RENDER_AUTO. The trails and velocity vectors are
+// drawn like in drawDiscs(). Without a framebuffer of words, the discs are
+// drawn by drawDiscs() instead.
+//
+template <class Real, int D>
+void drawSmoothDiscs(Surface& surface, int n, Atom<Real, D> atoms[]) {
+    const float scale = static_cast<float>(min(double(surface.getWidth()) / W, double(surface.getHeight()) / H));
+    const unsigned int* colors = atomColors.data();
+    Framebuffer fb = surface.beginAccess();
+    if (!fb.words) {
+        surface.endAccess();
+        drawDiscs(surface, n, atoms);
+        return;
+    }
+    drawBackground(fb, n, scale);
+
+    const long pitch = fb.stride / 4;
+    vector<float> alpha(fb.width + LANES);
+    for (int i = 0; i < n; i++) {
+        const unsigned int fg = wordOf(fb, colors[i]);
+        const float cx = static_cast<float>(atoms[i].x) * scale;
+        const float cy = static_cast<float>(atoms[i].y) * scale;
+        const float r = static_cast<float>(atoms[i].r) * scale;
+        if (r < 0.5f) {
+            float area = static_cast<float>(PI) * r * r;
+            float px = cx - 0.5f, py = cy - 0.5f;
+            int x0 = floorOf(px), y0 = floorOf(py);
+            float fx = px - x0, fy = py - y0;
+            for (int j = 0; j < 2; j++) {
+                int y = y0 + j;
+                if (y < 0 || y >= fb.height)
+                    continue;
+                float weights[2] = { area * (1 - fx) * (j ? fy : 1 - fy), area * fx * (j ? fy : 1 - fy) };
+                blendSpan(fb.words + y * pitch, fb.width, x0, x0 + 1, fg, weights);
+            }
+            continue;
+        }
+        if (r <= SMOOTH_STAMP) {
+            // the pixel px, py and the phase of the center, in 1/PHASES of a pixel
+            int qx = floorOf(cx * PHASES + 0.5f), qy = floorOf(cy * PHASES + 0.5f);
+            int px = qx >> PHASE_BITS, py = qy >> PHASE_BITS;
+            int k = static_cast<int>((r - 0.5f) * RADII + 0.5f);
+            const Coverage& stamp = coverages[(k * PHASES + (qy & (PHASES - 1))) * PHASES + (qx & (PHASES - 1))];
+            int x = px + stamp.x0, y = py + stamp.y0;
+            if (x >= 0 && x + LANES <= fb.width && y >= 0 && y + SMOOTH_SIDE <= fb.height) {
+                unsigned int* p = fb.words + y * pitch + x;
+                for (int j = 0; j < SMOOTH_SIDE; j++)
+                    blendLanes(p + j * pitch, fg, stamp.weight[j]);
+                continue;
+            }
+            for (int j = max(-y, 0); j < min(SMOOTH_SIDE, fb.height - y); j++) {
+                float weights[LANES];
+                for (int l = 0; l < LANES; l++)
+                    weights[l] = stamp.weight[j][2 * l] / 256.0f;
+                blendSpan(fb.words + (y + j) * pitch, fb.width, x, x + LANES - 1, fg, weights);
+            }
+            continue;
+        }
+        // pixel centers with d*d < r*r + r are touched, those with d*d <= r*r - r fully covered
+        const float outer = r * r + r, inner = r * r - r;
+        const float reach = sqrt(outer);
+        if (r <= SMOOTH_BOX) {
+            int xa = -floorOf(reach + 0.5f - cx), xb = floorOf(cx + reach - 0.5f);
+            int ya = max(-floorOf(reach + 0.5f - cy), 0), yb = min(floorOf(cy + reach - 0.5f), fb.height - 1);
+            bool inside = xa >= 0 && xb < fb.width - LANES;
+            for (int y = ya; y <= yb; y++) {
+                float dy = y + 0.5f - cy;
+                unsigned int* row = fb.words + y * pitch;
+                for (int x = xa; x <= xb; x += LANES) {
+                    Lanes a;
+                    cover(x + 0.5f - cx, dy * dy, r, a);
+                    if (inside) {
+                        blendLanes(row + x, fg, a);
+                    }
+                    else {
+                        memcpy(alpha.data(), &a, sizeof(a));
+                        blendSpan(row, fb.width, x, min(x + LANES - 1, xb), fg, alpha.data());
+                    }
+                }
+            }
+            continue;
+        }
+        int ya = max(-floorOf(reach + 0.5f - cy), 0);
+        int yb = min(floorOf(cy + reach - 0.5f), fb.height - 1);
+        for (int y = ya; y <= yb; y++) {
+            float dy = y + 0.5f - cy, dy2 = dy * dy;
+            if (dy2 >= outer)
+                continue;
+            float ho = sqrt(outer - dy2);
+            int xa = -floorOf(ho + 0.5f - cx);
+            int xb = floorOf(cx + ho - 0.5f);
+            if (xb < 0 || xa >= fb.width || xa > xb)
+                continue;
+            unsigned int* row = fb.words + y * pitch;
+            // blends the edge pixels x0..x1, clipped to the row
+            auto edge = [&](int x0, int x1) {
+                x0 = max(x0, 0);
+                x1 = min(x1, fb.width - 1);
+                if (x0 > x1)
+                    return;
+                coverage(x1 - x0 + 1, x0 + 0.5f - cx, dy2, r, alpha.data());
+                blendSpan(row, fb.width, x0, x1, fg, alpha.data());
+            };
+            int xi0 = xb + 1, xi1 = xb;
+            if (dy2 <= inner) {
+                float hi = sqrt(inner - dy2);
+                xi0 = max(-floorOf(hi + 0.5f - cx), xa);
+                xi1 = min(floorOf(cx + hi - 0.5f), xb);
+                if (xi0 > xi1) {
+                    xi0 = xb + 1;
+                    xi1 = xb;
+                }
+            }
+            edge(xa, xi0 - 1);
+            if (xi0 <= xi1) {
+                int x0 = max(xi0, 0), x1 = min(xi1, fb.width - 1);
+                if (x0 <= x1)
+                    fill_n(row + x0, x1 - x0 + 1, fg);
+                edge(xi1 + 1, xb);
+            }
+        }
+    }
+    surface.endAccess();
+    drawVectors(surface, n, atoms, scale);
+}
+
+//
+// Cell: Accumulated area and momentum (area-weighted velocity) of the atoms
+// whose centers lie in one cell of the density field.
+//
+struct Cell {
+    float area;
+    float px, py;
+};
+
+//
+// heat: Maps a cell coverage c (0 = empty, 1 = fully covered) to a color
+// fading from white through yellow and red to black.
+//
+unsigned int heat(double c) {
+    c = min(max(c, 0.0), 1.0);
+    int r, g, b;
+    if (c < 1.0 / 3) {
+        r = 255; g = 255; b = static_cast<int>(255 * (1 - 3 * c));
+    }
+    else if (c < 2.0 / 3) {
+        r = 255; g = static_cast<int>(255 * (2 - 3 * c)); b = 0;
+    }
+    else {
+        r = static_cast<int>(255 * (3 - 3 * c)); g = 0; b = 0;
+    }
+    return (r << 16) | (g << 8) | b;
+}
+
+//
+// flow: Maps a mean speed v (relative to V1) to a color from blue (at rest)
+// to red (V1 and faster), blended towards white by the cell coverage c.
+//
+unsigned int flow(double v, double c) {
+    double t = min(max(v / V1, 0.0), 1.0);
+    c = min(max(c, 0.0), 1.0);
+    int r = static_cast<int>(255 * (1 - c) + 255 * t * c);
+    int g = static_cast<int>(255 * (1 - c));
+    int b = static_cast<int>(255 * (1 - c) + 255 * (1 - t) * c);
+    return (r << 16) | (g << 8) | b;
+}
+
+//
+// drawDensity: Draws the atoms as a field of CELL*CELL pixel cells, colored by
+// the fraction of the cell area covered by atoms (or, if velocity is set, by
+// the mean velocity of these atoms). Each worker splats its chunk of atoms into
+// a private grid at the cell of the atom center; the grids are then summed in
+// parallel over the cells and written row by row into the framebuffer, so the
+// cost is O(n + W*H) without any contention.
+//
+template <class Real, int D>
+void drawDensity(Surface& surface, int n, Atom<Real, D> atoms[], bool velocity) {
+    const double scale = min(double(surface.getWidth()) / W, double(surface.getHeight()) / H);
+    const int gw = (surface.getWidth() + CELL - 1) / CELL;
+    const int gh = (surface.getHeight() + CELL - 1) / CELL;
+    const int cells = gw * gh;
+    int t = workers(n);
+    vector<Cell> grids(static_cast<size_t>(t) * cells);
+    memset(grids.data(), 0, grids.size() * sizeof(Cell));
+
+    parallelFor(n, [&](int begin, int end, int w) {
+        Cell* grid = &grids[static_cast<size_t>(w) * cells];
+        for (int i = begin; i < end; i++) {
+            int cx = static_cast<int>(atoms[i].x * scale) / CELL;
+            int cy = static_cast<int>(atoms[i].y * scale) / CELL;
+            if (cx < 0 || cx >= gw || cy < 0 || cy >= gh)
+                continue;
+            float a = static_cast<float>(PI * atoms[i].r * atoms[i].r * scale * scale);
+            Cell& cell = grid[cy * gw + cx];
+            cell.area += a;
+            cell.px += a * static_cast<float>(atoms[i].vx);
+            cell.py += a * static_cast<float>(atoms[i].vy);
+        }
+    });
+    parallelFor(cells, [&](int begin, int end) {
+        for (int w = 1; w < t; w++) {
+            const Cell* grid = &grids[static_cast<size_t>(w) * cells];
+            for (int c = begin; c < end; c++) {
+                grids[c].area += grid[c].area;
+                grids[c].px += grid[c].px;
+                grids[c].py += grid[c].py;
+            }
+        }
+    });
+
+    const double cellArea = CELL * CELL;
+    vector<unsigned int> colors(gw);
+    Framebuffer fb = surface.beginAccess();
+    for (int cy = 0; cy < gh; cy++) {
+        for (int cx = 0; cx < gw; cx++) {
+            const Cell& cell = grids[cy * gw + cx];
+            if (cell.area == 0)
+                colors[cx] = 0xFFFFFF;
+            else if (velocity)
+                colors[cx] = flow(hypot(cell.px, cell.py) / cell.area, cell.area / cellArea);
+            else
+                colors[cx] = heat(cell.area / cellArea);
+        }
+        for (int y = cy * CELL; y < (cy + 1) * CELL; y++)
+            for (int cx = 0; cx < gw; cx++)
+                putSpan(fb, cx * CELL, (cx + 1) * CELL - 1, y, colors[cx]);
+    }
+    surface.endAccess();
+}
+
+//
+// drawScene: Draws the obstacles over the atoms, in gray, and the moving walls.
+//
+void drawScene(Surface& surface) {
+    const unsigned int gray = 0x808080;
+    double scale = min(double(surface.getWidth()) / W, double(surface.getHeight()) / H);
+    if (boundaryMode == BOUNDARY_PISTONS) {
+        int x0 = static_cast<int>(box.x0 * scale), x1 = static_cast<int>(box.x1 * scale);
+        int y0 = static_cast<int>(box.y0 * scale), y1 = static_cast<int>(box.y1 * scale);
+        surface.drawRectangle(x0, y0, max(x1 - x0, 1), max(y1 - y0, 1), 0);
+    }
+    for (const vector<int>& corners : scene.polygons) {
+        int k = static_cast<int>(corners.size()) / 2;
+        vector<int> xs(k), ys(k);
+        for (int i = 0; i < k; i++) {
+            xs[i] = static_cast<int>(corners[2 * i] * scale);
+            ys[i] = static_cast<int>(corners[2 * i + 1] * scale);
+        }
+        surface.fillPolygon(k, xs.data(), ys.data(), gray, NO_COLOR);
+    }
+    for (size_t k = 0; k < scene.x0.size(); k++)
+        surface.drawLine(static_cast<int>(scene.x0[k] * scale), static_cast<int>(scene.y0[k] * scale),
+                         static_cast<int>(scene.x1[k] * scale), static_cast<int>(scene.y1[k] * scale), gray);
+    for (size_t k = 0; k < scene.cx.size(); k++) {
+        int d = static_cast<int>(2 * scene.cr[k] * scale);
+        surface.fillEllipse(static_cast<int>((scene.cx[k] - scene.cr[k]) * scale),
+                            static_cast<int>((scene.cy[k] - scene.cr[k]) * scale), d, d, gray, NO_COLOR);
+    }
+}
+
+//
+// draw: Draws the atoms on the surface in the current render mode, and the
+// obstacles over them, and flushes the output.
+//
+template <class Real, int D>
+void draw(Surface& surface, int n, Atom<Real, D> atoms[]) {
+    RenderMode mode = renderMode;
+    if (mode == RENDER_AUTO)
+        mode = (n >= DENSITY_N) ? RENDER_DENSITY : RENDER_DISCS;
+    if (mode == RENDER_DISCS)
+        drawDiscs(surface, n, atoms);
+    else if (mode == RENDER_SMOOTH)
+        drawSmoothDiscs(surface, n, atoms);
+    else
+        drawDensity(surface, n, atoms, mode == RENDER_VELOCITY);
+    drawScene(surface);
+    surface.flush();
+}
+
+//
+// Engine configuration: The inner loops of update() are instantiated for a
+// combination of policies chosen once at startup by dispatch(), so they do
+// not contain any checks of the configuration:
+// - the precision Real of the atoms (float or double),
+// - the number D of dimensions (discs or spheres),
+// - the Boundary of the box (Walls, Periodic or MovingWalls),
+// - the Broadphase that finds the candidate pairs (AllPairs, Grid or NoPairs),
+// - the Collision model that resolves a collision (Elastic or Inelastic).
+//
+
+//
+// Walls: The box is bounded by four walls (six in 3D). If an atom's center is closer to a
+// wall than its radius, the atom is repositioned and the corresponding velocity
+// component is inverted.
+//
+struct Walls {
+    static const bool periodic = false;
+
+    template <class Real>
+    static void advance(Real) {
+    }
+
+    template <class Real, int D>
+    static void move(Atom<Real, D>& atom, int) {
+        // Left wall
+        if (atom.x - atom.r <= 0) {
+            atom.x = atom.r;
+            atom.vx = -atom.vx;
+        }
+        // Right wall
+        if (atom.x + atom.r >= W) {
+            atom.x = W - atom.r;
+            atom.vx = -atom.vx;
+        }
+        // Top wall
+        if (atom.y - atom.r <= 0) {
+            atom.y = atom.r;
+            atom.vy = -atom.vy;
+        }
+        // Bottom wall
+        if (atom.y + atom.r >= H) {
+            atom.y = H - atom.r;
+            atom.vy = -atom.vy;
+        }
+        depth(atom);
+    }
+
+    template <class Real>
+    static void depth(Atom<Real>&) {
+    }
+
+    template <class Real>
+    static void depth(Atom<Real, 3>& atom) {
+        // Front wall
+        if (atom.z - atom.r <= 0) {
+            atom.z = atom.r;
+            atom.vz = -atom.vz;
+        }
+        // Back wall
+        if (atom.z + atom.r >= Z) {
+            atom.z = Z - atom.r;
+            atom.vz = -atom.vz;
+        }
+    }
+
+    template <class Real>
+    static void separation(Real&, Real&) {
+    }
+
+    template <class Real>
+    static void separation(Real&, Real&, Real&) {
+    }
+};
+
+//
+// Periodic: The box wraps around, so an atom's center leaving it on one side
+// reenters it on the opposite side, and the separation of two atoms is that
+// of their nearest periodic images.
+//
+struct Periodic {
+    static const bool periodic = true;
+
+    template <class Real>
+    static void advance(Real) {
+    }
+
+    template <class Real, int D>
+    static void move(Atom<Real, D>& atom, int) {
+        if (atom.x < 0) atom.x += W;
+        else if (atom.x >= W) atom.x -= W;
+        if (atom.y < 0) atom.y += H;
+        else if (atom.y >= H) atom.y -= H;
+        depth(atom);
+    }
+
+    template <class Real>
+    static void depth(Atom<Real>&) {
+    }
+
+    template <class Real>
+    static void depth(Atom<Real, 3>& atom) {
+        if (atom.z < 0) atom.z += Z;
+        else if (atom.z >= Z) atom.z -= Z;
+    }
+
+    template <class Real>
+    static void separation(Real& dx, Real& dy) {
+        if (dx > W / 2) dx -= W;
+        else if (dx < -W / 2) dx += W;
+        if (dy > H / 2) dy -= H;
+        else if (dy < -H / 2) dy += H;
+    }
+
+    template <class Real>
+    static void separation(Real& dx, Real& dy, Real& dz) {
+        separation(dx, dy);
+        if (dz > Z / 2) dz -= Z;
+        else if (dz < -Z / 2) dz += Z;
+    }
+};
+
+//
+// MovingWalls: The box is bounded by the four walls of box, which advance() moves
+// with their velocities. An atom touching a wall is moved back inside, and if
+// it approaches the wall, its velocity relative to the wall is reflected,
+// v' = 2*vw - v, and the change of its momentum is added to the impulse of the
+// wall. In 3D, the front and back walls are fixed like those of Walls.
+//
+struct MovingWalls {
+    static const bool periodic = false;
+
+    template <class Real>
+    static void advance(Real dt) {
+        box.exposure[0] += (box.y1 - box.y0) * dt;
+        box.exposure[1] += (box.y1 - box.y0) * dt;
+        box.exposure[2] += (box.x1 - box.x0) * dt;
+        box.exposure[3] += (box.x1 - box.x0) * dt;
+        double x0 = box.x0 + box.v[0] * dt, x1 = box.x1 + box.v[1] * dt;
+        double y0 = box.y0 + box.v[2] * dt, y1 = box.y1 + box.v[3] * dt;
+        if (x0 < 0 || x0 > W || x1 - x0 < box.gap) box.v[0] = 0;
+        else box.x0 = x0;
+        if (x1 < 0 || x1 > W || x1 - box.x0 < box.gap) box.v[1] = 0;
+        else box.x1 = x1;
+        if (y0 < 0 || y0 > H || y1 - y0 < box.gap) box.v[2] = 0;
+        else box.y0 = y0;
+        if (y1 < 0 || y1 > H || y1 - box.y0 < box.gap) box.v[3] = 0;
+        else box.y1 = y1;
+    }
+
+    template <class Real, int D>
+    static void move(Atom<Real, D>& atom, int i) {
+        // Left wall
+        if (atom.x - atom.r <= box.x0) {
+            atom.x = static_cast<Real>(box.x0 + atom.r);
+            if (atom.vx < box.v[0]) {
+                Real v = static_cast<Real>(2 * box.v[0] - atom.vx);
+                box.impulse[0] += massOf(atom, i) * (v - atom.vx);
+                atom.vx = v;
+            }
+        }
+        // Right wall
+        if (atom.x + atom.r >= box.x1) {
+            atom.x = static_cast<Real>(box.x1 - atom.r);
+            if (atom.vx > box.v[1]) {
+                Real v = static_cast<Real>(2 * box.v[1] - atom.vx);
+                box.impulse[1] += massOf(atom, i) * (atom.vx - v);
+                atom.vx = v;
+            }
+        }
+        // Top wall
+        if (atom.y - atom.r <= box.y0) {
+            atom.y = static_cast<Real>(box.y0 + atom.r);
+            if (atom.vy < box.v[2]) {
+                Real v = static_cast<Real>(2 * box.v[2] - atom.vy);
+                box.impulse[2] += massOf(atom, i) * (v - atom.vy);
+                atom.vy = v;
+            }
+        }
+        // Bottom wall
+        if (atom.y + atom.r >= box.y1) {
+            atom.y = static_cast<Real>(box.y1 - atom.r);
+            if (atom.vy > box.v[3]) {
+                Real v = static_cast<Real>(2 * box.v[3] - atom.vy);
+                box.impulse[3] += massOf(atom, i) * (atom.vy - v);
+                atom.vy = v;
+            }
+        }
+        Walls::depth(atom);
+    }
+
+    template <class Real>
+    static void separation(Real&, Real&) {
+    }
+
+    template <class Real>
+    static void separation(Real&, Real&, Real&) {
+    }
+};
+
+//
+// startBox: Sets the smallest width and height of a box with moving walls to
+// twice the largest diameter of the atoms.
+//
+template <class Real, int D>
+void startBox(int n, Atom<Real, D> atoms[]) {
+    for (int i = 0; i < n; i++)
+        box.gap = max(box.gap, 4.0 * atoms[i].r);
+}
+
+//
+// reportBox: Prints the size of the box and the mean pressure on each of its
+// moving walls, the momentum taken from the atoms per unit of length (of area
+// in 3D) and time.
+//
+void reportBox() {
+    const char* names[4] = { "left", "right", "top", "bottom" };
+    cout << "Box: " << box.x1 - box.x0 << "x" << box.y1 - box.y0 << ", pressure:";
+    for (int k = 0; k < 4; k++) {
+        double exposure = box.exposure[k] * (dimensions == 3 ? Z : 1);
+        cout << " " << names[k] << " " << (exposure > 0 ? box.impulse[k] / exposure : 0.0);
+    }
+    cout << endl;
+}
+
+//
+// AllPairs: Visits every pair of atoms i < j.
+//
+struct AllPairs {
+    template <class Boundary, class Real, int D, class Visit>
+    void pairs(int n, Atom<Real, D> atoms[], Visit visit) {
+        (void)atoms;
+        for (int i = 0; i < n; i++)
+            for (int j = i + 1; j < n; j++)
+                visit(i, j);
+    }
+};
+
+//
+// Grid: Sorts the atoms by their center into a uniform grid of cells at least
+// as wide as the largest atom (and as the given reach of an interaction), so
+// that only atoms in the same or in adjacent cells can interact. Each cell is
+// paired with itself and with half of its neighbors (4 of 8 in 2D, 13 of 26 in
+// 3D), which visits every candidate pair once. The arrays are kept from step
+// to step and only grow.
+//
+// In a periodic box, a dimension less than 3 cells wide is made a single cell
+// (its neighbors on both sides would be the same cell), and the pairs across
+// it are found within the cells. A box less than 3 cells wide in every
+// dimension is thus a single cell, and all pairs are visited, with their
+// minimum image separation: O(n^2), as with AllPairs.
+//
+template <int D = 2>
+struct Grid {
+    int gw, gh, gd;      // number of columns, rows and layers
+    double cw, ch, cd;   // width, height and depth of a cell
+    vector<int> cell;    // cell of each atom
+    vector<int> start;   // atoms of cell c are order[start[c]..start[c+1]-1]
+    vector<int> order;   // atom indices sorted by cell
+
+    template <class Boundary, class Real>
+    void build(int n, Atom<Real, D> atoms[], double reach = 0) {
+        double d = reach;
+        for (int i = 0; i < n; i++)
+            d = max(d, 2.0 * atoms[i].r);
+        // in 3D, at least one atom per eight cells on average
+        if (D == 3)
+            d = max(d, cbrt(double(W) * H * Z / (8.0 * max(n, 1))));
+        gw = max(1, static_cast<int>(W / max(d, 1.0)));
+        gh = max(1, static_cast<int>(H / max(d, 1.0)));
+        gd = D == 3 ? max(1, static_cast<int>(Z / max(d, 1.0))) : 1;
+        // the neighbors of a cell must be distinct in a periodic box
+        if (Boundary::periodic) {
+            gw = gw < 3 ? 1 : gw;
+            gh = gh < 3 ? 1 : gh;
+            gd = gd < 3 ? 1 : gd;
+        }
+        cw = double(W) / gw;
+        ch = double(H) / gh;
+        cd = double(Z) / gd;
+
+        const int cells = gw * gh * gd;
+        cell.resize(n);
+        order.resize(n);
+        start.assign(cells + 1, 0);
+        for (int i = 0; i < n; i++) {
+            int cx = min(max(static_cast<int>(atoms[i].x / cw), 0), gw - 1);
+            int cy = min(max(static_cast<int>(atoms[i].y / ch), 0), gh - 1);
+            cell[i] = cy * gw + cx;
+            if (D == 3)
+                cell[i] += min(max(static_cast<int>(depthOf(atoms[i]) / cd), 0), gd - 1) * gw * gh;
+            start[cell[i] + 1]++;
+        }
+        for (int c = 0; c < cells; c++)
+            start[c + 1] += start[c];
+        for (int i = 0; i < n; i++)
+            order[start[cell[i]]++] = i;
+        for (int c = cells; c > 0; c--)
+            start[c] = start[c - 1];
+        start[0] = 0;
+    }
+
+    // visits the pairs of atom order[a] with the atoms after it in its cell
+    // and with the atoms in half of the neighboring cells
+    template <class Boundary, class Visit>
+    void pairsOf(int a, Visit visit) {
+        static const int offsets[13][3] = {
+            { 1, 0, 0 }, { -1, 1, 0 }, { 0, 1, 0 }, { 1, 1, 0 },
+            { -1, -1, 1 }, { 0, -1, 1 }, { 1, -1, 1 }, { -1, 0, 1 }, { 0, 0, 1 },
+            { 1, 0, 1 }, { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 }
+        };
+        int i = order[a];
+        int c = cell[i];
+        for (int b = a + 1; b < start[c + 1]; b++)
+            visit(i, order[b]);
+        if (gw * gh == 1 && gd == 1)
+            return;
+        int cx = c % gw;
+        int cy = D == 3 ? c / gw % gh : c / gw;
+        int cz = D == 3 ? c / (gw * gh) : 0;
+        for (int k = 0; k < (D == 3 ? 13 : 4); k++) {
+            // a dimension of a single cell has no neighbors
+            if ((gw == 1 && offsets[k][0]) || (gh == 1 && offsets[k][1]) || (gd == 1 && offsets[k][2]))
+                continue;
+            int nx = cx + offsets[k][0];
+            int ny = cy + offsets[k][1];
+            int nz = cz + offsets[k][2];
+            if (Boundary::periodic) {
+                nx = (nx + gw) % gw;
+                ny = (D == 3 ? ny + gh : ny) % gh;
+                nz = D == 3 ? nz % gd : 0;
+            }
+            else if (nx < 0 || nx >= gw || ny >= gh || (D == 3 && (ny < 0 || nz >= gd))) {
+                continue;
+            }
+            int c2 = (nz * gh + ny) * gw + nx;
+            for (int b = start[c2]; b < start[c2 + 1]; b++)
+                visit(i, order[b]);
+        }
+    }
+
+    template <class Boundary, class Real, class Visit>
+    void pairs(int n, Atom<Real, D> atoms[], Visit visit) {
+        build<Boundary>(n, atoms);
+        for (int a = 0; a < n; a++)
+            pairsOf<Boundary>(a, visit);
+    }
+};
+
+//
+// NoPairs: Visits no pairs at all; used when a soft potential with a repulsive
+// core takes the place of the hard-disc collisions.
+//
+struct NoPairs {
+    template <class Boundary, class Real, int D, class Visit>
+    void pairs(int, Atom<Real, D>[], Visit) {
+    }
+};
+
+//
+// Elastic: Resolves each collision of two atoms, whose centers are separated by
+// dx, dy, as soon as it is found by updating the velocity components along the
+// collision axis, using an elastic collision model with masses proportional to
+// the square of the radii.
+//
+template <class Real>
+struct Elastic {
+    void contact(Atom<Real> atoms[], int i, int j, Real dx, Real dy) {
+        Atom<Real>& ai = atoms[i];
+        Atom<Real>& aj = atoms[j];
+
+        // Compute tangent vector (perpendicular to line joining centers)
+        Real tx = -dy;
+        Real ty = dx;
+        Real a = atan2(ty, tx);  // angle of the tangent
+
+        // Get polar coordinates of velocities
+        Real vi_speed = sqrt(ai.vx * ai.vx + ai.vy * ai.vy);
+        Real vj_speed = sqrt(aj.vx * aj.vx + aj.vy * aj.vy);
+        Real vi_angle = atan2(ai.vy, ai.vx);
+        Real vj_angle = atan2(aj.vy, aj.vx);
+
+        // Rotate velocities so that the tangent is horizontal
+        Real vi_rot_angle = vi_angle - a;
+        Real vj_rot_angle = vj_angle - a;
+
+        // Decompose velocities in the rotated coordinate system
+        Real vi_horiz = vi_speed * cos(vi_rot_angle);
+        Real vi_vert = vi_speed * sin(vi_rot_angle);
+        Real vj_horiz = vj_speed * cos(vj_rot_angle);
+        Real vj_vert = vj_speed * sin(vj_rot_angle);
+
+        // Masses proportional to the square of the radii and the density of the species
+        Real m1 = ai.r * ai.r * static_cast<Real>(densityOf(i));
+        Real m2 = aj.r * aj.r * static_cast<Real>(densityOf(j));
+        // Compute center-of-mass velocity along the collision axis (vertical component)
+        Real V_center = (m1 * vi_vert + m2 * vj_vert) / (m1 + m2);
+        // Compute new vertical velocities after collision (elastic collision)
+        Real vi_vert_new = 2 * V_center - vi_vert;
+        Real vj_vert_new = 2 * V_center - vj_vert;
+
+        // Recombine with unchanged horizontal components
+        Real vi_rot_speed_new = sqrt(vi_horiz * vi_horiz + vi_vert_new * vi_vert_new);
+        Real vj_rot_speed_new = sqrt(vj_horiz * vj_horiz + vj_vert_new * vj_vert_new);
+        Real vi_rot_angle_new = atan2(vi_vert_new, vi_horiz);
+        Real vj_rot_angle_new = atan2(vj_vert_new, vj_horiz);
+
+        // Rotate velocities back to original coordinate system
+        Real vi_final_angle = vi_rot_angle_new + a;
+        Real vj_final_angle = vj_rot_angle_new + a;
+        ai.vx = vi_rot_speed_new * cos(vi_final_angle);
+        ai.vy = vi_rot_speed_new * sin(vi_final_angle);
+        aj.vx = vj_rot_speed_new * cos(vj_final_angle);
+        aj.vy = vj_rot_speed_new * sin(vj_final_angle);
+    }
+
+    // the same for spheres, as an impulse along the collision axis, with
+    // masses proportional to the cube of the radii and the density
+    void contact(Atom<Real, 3> atoms[], int i, int j, Real dx, Real dy, Real dz) {
+        Atom<Real, 3>& ai = atoms[i];
+        Atom<Real, 3>& aj = atoms[j];
+        Real d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 == 0)
+            return;
+        Real m1 = ai.r * ai.r * ai.r * static_cast<Real>(densityOf(i));
+        Real m2 = aj.r * aj.r * aj.r * static_cast<Real>(densityOf(j));
+        // exchange the velocity components along the axis in the center of mass frame
+        Real vn = ((aj.vx - ai.vx) * dx + (aj.vy - ai.vy) * dy + (aj.vz - ai.vz) * dz) / d2;
+        Real ji = 2 * m2 / (m1 + m2) * vn;
+        Real jj = 2 * m1 / (m1 + m2) * vn;
+        ai.vx += ji * dx;
+        ai.vy += ji * dy;
+        ai.vz += ji * dz;
+        aj.vx -= jj * dx;
+        aj.vy -= jj * dy;
+        aj.vz -= jj * dz;
+    }
+
+    template <int D>
+    void finish(Atom<Real, D>[]) {
+    }
+};
+
+//
+// Inelastic: Collects the collisions found in a step into a batch of contacts
+// and then resolves them by impulses along the collision normal n (pointing
+// from atom i to atom j) with masses proportional to the square of the radii.
+// An approaching pair with normal relative velocity vn < 0 receives the normal
+// impulse -(1+e)*vn*m, where m = mi*mj/(mi+mj) is the reduced mass and e the
+// smaller coefficient of restitution of the two atoms, and a Coulomb friction
+// impulse against the tangential relative velocity vt of magnitude
+// min(friction*normal impulse, |vt|*m).
+// The contacts are ordered into layers, such that a contact comes after all
+// earlier contacts sharing an atom with it and the contacts within a layer
+// share no atoms. Each layer is then gathered into separate arrays whose
+// impulses are computed in one branch-free loop that the compiler can
+// vectorize, and scattered back to the atoms; the result is the same as
+// resolving the contacts one after the other in the order found.
+//
+template <class Real>
+struct Inelastic {
+    vector<int> ci, cj;              // atoms of each contact
+    vector<Real> nx, ny;             // collision normal of each contact
+    vector<int> layer;               // layer of each contact
+    vector<int> depth;               // number of layers so far containing an atom
+    vector<int> start;               // contacts of layer l are order[start[l]..start[l+1]-1]
+    vector<int> order;               // contacts sorted by layer
+    vector<Real> bnx, bny, rvx, rvy, wi, wj, e, px, py;  // batch of one layer
+
+    // Computes the impulses (px, py) on atom j (-impulse on atom i) of size
+    // contacts given as separate arrays; the loop vectorizes if the square
+    // root need not set errno (-fno-math-errno)
+    static void impulses(int size, Real mu, const Real* nx, const Real* ny,
+                         const Real* rvx, const Real* rvy, const Real* wi, const Real* wj,
+                         const Real* e, Real* __restrict px, Real* __restrict py) {
+        for (int q = 0; q < size; q++) {
+            Real mass = 1 / (wi[q] + wj[q]);
+            Real vn = rvx[q] * nx[q] + rvy[q] * ny[q];
+            Real jn = max(Real(0), -(1 + e[q]) * vn * mass);
+            Real tx = rvx[q] - vn * nx[q];
+            Real ty = rvy[q] - vn * ny[q];
+            Real vt = sqrt(tx * tx + ty * ty);
+            Real jt = min(mu * jn, vt * mass) / max(vt, Real(1e-12));
+            px[q] = jn * nx[q] - jt * tx;
+            py[q] = jn * ny[q] - jt * ty;
+        }
+    }
+
+    void contact(Atom<Real>[], int i, int j, Real dx, Real dy) {
+        Real dist = sqrt(dx * dx + dy * dy);
+        ci.push_back(i);
+        cj.push_back(j);
+        nx.push_back(dist == 0 ? 1 : dx / dist);
+        ny.push_back(dist == 0 ? 0 : dy / dist);
+    }
+
+    void finish(Atom<Real> atoms[]) {
+        const int m = static_cast<int>(ci.size());
+        if (m == 0)
+            return;
+
+        // Order the contacts into layers
+        int layers = 0;
+        layer.resize(m);
+        for (int k = 0; k < m; k++) {
+            int i = ci[k], j = cj[k];
+            if (max(i, j) >= static_cast<int>(depth.size()))
+                depth.resize(max(i, j) + 1, 0);
+            int l = max(depth[i], depth[j]);
+            layer[k] = l;
+            depth[i] = depth[j] = l + 1;
+            layers = max(layers, l + 1);
+        }
+        start.assign(layers + 1, 0);
+        for (int k = 0; k < m; k++)
+            start[layer[k] + 1]++;
+        for (int l = 0; l < layers; l++)
+            start[l + 1] += start[l];
+        order.resize(m);
+        for (int k = 0; k < m; k++)
+            order[start[layer[k]]++] = k;
+        for (int l = layers; l > 0; l--)
+            start[l] = start[l - 1];
+        start[0] = 0;
+
+        const Real mu = static_cast<Real>(friction);
+        for (int l = 0; l < layers; l++) {
+            const int b = start[l];
+            const int size = start[l + 1] - b;
+            for (vector<Real>* v : { &bnx, &bny, &rvx, &rvy, &wi, &wj, &e, &px, &py })
+                v->resize(size);
+
+            // Gather the contacts of the layer
+            for (int q = 0; q < size; q++) {
+                int k = order[b + q];
+                const Atom<Real>& ai = atoms[ci[k]];
+                const Atom<Real>& aj = atoms[cj[k]];
+                bnx[q] = nx[k];
+                bny[q] = ny[k];
+                rvx[q] = aj.vx - ai.vx;
+                rvy[q] = aj.vy - ai.vy;
+                wi[q] = 1 / (ai.r * ai.r * static_cast<Real>(densityOf(ci[k])));
+                wj[q] = 1 / (aj.r * aj.r * static_cast<Real>(densityOf(cj[k])));
+                e[q] = static_cast<Real>(interactionOf(ci[k], cj[k]).restitution);
+            }
+
+            impulses(size, mu, bnx.data(), bny.data(), rvx.data(), rvy.data(),
+                     wi.data(), wj.data(), e.data(), px.data(), py.data());
+
+            // Scatter the impulses to the atoms
+            for (int q = 0; q < size; q++) {
+                int k = order[b + q];
+                Atom<Real>& ai = atoms[ci[k]];
+                Atom<Real>& aj = atoms[cj[k]];
+                ai.vx -= px[q] * wi[q];
+                ai.vy -= py[q] * wi[q];
+                aj.vx += px[q] * wj[q];
+                aj.vy += py[q] * wj[q];
+            }
+        }
+
+        for (int k = 0; k < m; k++)
+            depth[ci[k]] = depth[cj[k]] = 0;
+        ci.clear();
+        cj.clear();
+        nx.clear();
+        ny.clear();
+    }
+};
+
+//
+// chargeOf, responseOf: The source of the long-range interaction of an atom,
+// its mass for gravity and its area (the charge of a uniformly charged disc)
+// for Coulomb, and the ratio of the charge to the mass, by which the field
+// at the atom is multiplied to give its acceleration.
+//
+template <class Real>
+inline double chargeOf(const Atom<Real>& atom, int i) {
+    return longRange == LONGRANGE_GRAVITY ? massOf(atom, i) : double(atom.r) * atom.r;
+}
+
+inline double responseOf(int i) {
+    return longRange == LONGRANGE_GRAVITY ? 1.0 : 1.0 / densityOf(i);
+}
+
+//
+// Tree: A Barnes-Hut quadtree over the box. The atoms are sorted by the Morton
+// code of their position (a radix sort on 16 bits per coordinate), so that the
+// atoms of every node of the tree form a contiguous range of the sorted order,
+// and the quadrants of a node are found by binary search. The top TOP_LEVELS
+// levels are built first, then the subtrees below them in parallel, each into
+// a list of its own, which are finally appended to the tree. The children of a
+// node are stored contiguously after it, so the moments are computed from the
+// last node to the first.
+//
+const int TOP_LEVELS = 3;   // levels of the tree built before the subtrees
+const int LEAF = 8;         // largest number of atoms in a leaf
+const int DEPTH = 16;       // deepest level of the tree (bits per coordinate)
+
+struct Tree {
+    struct Node {
+        double x, y;      // center of mass
+        double m;         // mass
+        double qr, qi;    // quadrupole moment sum m*w*w with w = (x, y) - center of mass as complex
+        double size;      // width of the square covered by the node
+        int begin, end;   // atoms order[begin..end-1]
+        int level;        // depth of the node
+        int child;        // index of the first child (-1 for a leaf)
+        int children;     // number of (non-empty) children
+    };
+    vector<Node> nodes;
+    vector<unsigned> key, keys;   // Morton codes of the sorted atoms, and scratch
+    vector<int> order, orders;    // atom indices sorted by Morton code, and scratch
+    vector<double> px, py, pm;    // positions and masses of the sorted atoms
+    vector<int> count;
+    vector<int> roots;            // the nodes at which the subtrees start
+    vector<vector<Node> > subtrees;
+
+    static unsigned spread(unsigned v) {
+        v &= 0xFFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    // appends the children of node k, which must be the last node
+    void split(vector<Node>& list, int k) const {
+        Node node = list[k];
+        if (node.end - node.begin <= LEAF || node.level == DEPTH)
+            return;
+        int shift = 2 * (DEPTH - 1 - node.level);
+        list[k].child = static_cast<int>(list.size());
+        int begin = node.begin;
+        for (unsigned q = 0; q < 4; q++) {
+            int end = static_cast<int>(partition_point(key.begin() + begin, key.begin() + node.end,
+                [&](unsigned c) { return ((c >> shift) & 3) <= q; }) - key.begin());
+            if (end > begin) {
+                Node child = { 0, 0, 0, 0, 0, node.size / 2, begin, end, node.level + 1, -1, 0 };
+                list.push_back(child);
+                list[k].children++;
+            }
+            begin = end;
+        }
+    }
+
+    // builds the nodes below node 0 of list, down to the given depth
+    void grow(vector<Node>& list, int depth) const {
+        for (size_t k = 0; k < list.size(); k++)
+            if (list[k].level < depth)
+                split(list, static_cast<int>(k));
+    }
+
+    // computes the moments of the first length nodes of list above the given
+    // level, from the last to the first, from their atoms or from their children
+    void moments(vector<Node>& list, int length, int above) const {
+        for (int k = length - 1; k >= 0; k--) {
+            Node& node = list[k];
+            if (node.level >= above)
+                continue;
+            double m = 0, x = 0, y = 0, qr = 0, qi = 0;
+            if (node.child < 0) {
+                for (int b = node.begin; b < node.end; b++) {
+                    m += pm[b];
+                    x += pm[b] * px[b];
+                    y += pm[b] * py[b];
+                }
+            }
+            else {
+                for (int c = node.child; c < node.child + node.children; c++) {
+                    m += list[c].m;
+                    x += list[c].m * list[c].x;
+                    y += list[c].m * list[c].y;
+                }
+            }
+            if (m > 0) {
+                x /= m;
+                y /= m;
+            }
+            if (node.child < 0) {
+                for (int b = node.begin; b < node.end; b++) {
+                    double wx = px[b] - x, wy = py[b] - y;
+                    qr += pm[b] * (wx * wx - wy * wy);
+                    qi += pm[b] * 2 * wx * wy;
+                }
+            }
+            else {
+                for (int c = node.child; c < node.child + node.children; c++) {
+                    double wx = list[c].x - x, wy = list[c].y - y;
+                    qr += list[c].qr + list[c].m * (wx * wx - wy * wy);
+                    qi += list[c].qi + list[c].m * 2 * wx * wy;
+                }
+            }
+            node.m = m;
+            node.x = x;
+            node.y = y;
+            node.qr = qr;
+            node.qi = qi;
+        }
+    }
+
+    template <class Real>
+    void build(int n, Atom<Real> atoms[]) {
+        // sort the atoms by Morton code, 16 bits at a time
+        const double scale = 65536.0 / max(W, H);
+        key.resize(n);
+        keys.resize(n);
+        order.resize(n);
+        orders.resize(n);
+        parallelFor(n, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                unsigned cx = static_cast<unsigned>(min(max(atoms[i].x * scale, 0.0), 65535.0));
+                unsigned cy = static_cast<unsigned>(min(max(atoms[i].y * scale, 0.0), 65535.0));
+                keys[i] = spread(cx) << 1 | spread(cy);
+                orders[i] = i;
+            }
+        });
+        for (int shift = 0; shift < 32; shift += 16) {
+            count.assign(65537, 0);
+            for (int i = 0; i < n; i++)
+                count[((keys[i] >> shift) & 0xFFFF) + 1]++;
+            for (int c = 0; c < 65536; c++)
+                count[c + 1] += count[c];
+            for (int i = 0; i < n; i++) {
+                int p = count[(keys[i] >> shift) & 0xFFFF]++;
+                key[p] = keys[i];
+                order[p] = orders[i];
+            }
+            key.swap(keys);
+            order.swap(orders);
+        }
+        key.swap(keys);
+        order.swap(orders);
+        px.resize(n);
+        py.resize(n);
+        pm.resize(n);
+        parallelFor(n, [&](int begin, int end) {
+            for (int b = begin; b < end; b++) {
+                const Atom<Real>& a = atoms[order[b]];
+                px[b] = a.x;
+                py[b] = a.y;
+                pm[b] = chargeOf(a, order[b]);
+            }
+        });
+
+        // build the top levels, then the subtrees below their leaves
+        Node root = { 0, 0, 0, 0, 0, double(max(W, H)), 0, n, 0, -1, 0 };
+        nodes.assign(1, root);
+        grow(nodes, TOP_LEVELS);
+        int top = static_cast<int>(nodes.size());
+        roots.clear();
+        for (size_t k = 0; k < nodes.size(); k++)
+            if (nodes[k].child < 0 && nodes[k].level == TOP_LEVELS)
+                roots.push_back(static_cast<int>(k));
+        subtrees.resize(roots.size());
+        parallelFor(n, [&](int begin, int end) {
+            // the subtrees are taken by the chunk holding their first atom
+            for (size_t t = 0; t < roots.size(); t++) {
+                int b = nodes[roots[t]].begin;
+                if (b >= begin && b < end) {
+                    subtrees[t].assign(1, nodes[roots[t]]);
+                    grow(subtrees[t], DEPTH);
+                    moments(subtrees[t], static_cast<int>(subtrees[t].size()), DEPTH + 1);
+                }
+            }
+        });
+        for (size_t t = 0; t < roots.size(); t++) {
+            const vector<Node>& list = subtrees[t];
+            int offset = static_cast<int>(nodes.size()) - 1;
+            nodes[roots[t]] = list[0];
+            if (list[0].child >= 0)
+                nodes[roots[t]].child += offset;
+            for (size_t k = 1; k < list.size(); k++) {
+                nodes.push_back(list[k]);
+                if (list[k].child >= 0)
+                    nodes.back().child += offset;
+            }
+        }
+        moments(nodes, top, TOP_LEVELS);
+    }
+};
+
+//
+// Mesh: The grids of the particle-mesh solver, meshSize*meshSize cells over the
+// periodic box, stored row by row. The density is deposited into a grid per
+// worker, which are then summed into the first one.
+//
+struct Mesh {
+    int mw, mh;              // number of columns and rows
+    vector<double> rho;      // mass per unit area, one grid per worker
+    vector<double> re, im;   // spectrum of the density, then the field
+};
+
+//
+// fft: Computes in place the discrete Fourier transform of the n complex values
+// (re[k], im[k]), with n a power of 2, by the iterative radix-2 algorithm, or
+// the inverse transform (without the division by n).
+//
+void fft(double re[], double im[], int n, bool inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            swap(re[i], re[j]);
+            swap(im[i], im[j]);
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        double angle = (inverse ? 2 : -2) * PI / len;
+        double wr = cos(angle), wi = sin(angle);
+        for (int i = 0; i < n; i += len) {
+            double ur = 1, ui = 0;
+            for (int j = 0; j < len / 2; j++) {
+                double* ar = &re[i + j];
+                double* ai = &im[i + j];
+                double* br = &re[i + j + len / 2];
+                double* bi = &im[i + j + len / 2];
+                double tr = *br * ur - *bi * ui;
+                double ti = *br * ui + *bi * ur;
+                *br = *ar - tr;
+                *bi = *ai - ti;
+                *ar += tr;
+                *ai += ti;
+                double u = ur * wr - ui * wi;
+                ui = ur * wi + ui * wr;
+                ur = u;
+            }
+        }
+    }
+}
+
+//
+// fft2: Computes in place the 2D transform of the mw*mh grid (re, im), row by
+// row and then column by column, the rows and the columns being spread over
+// the workers (each column is copied into a buffer of its worker).
+//
+void fft2(double re[], double im[], int mw, int mh, bool inverse) {
+    parallelFor(mw * mh, [&](int begin, int end) {
+        for (int j = (begin + mw - 1) / mw; j * mw < end; j++)
+            fft(re + long(j) * mw, im + long(j) * mw, mw, inverse);
+    });
+    parallelFor(mw * mh, [&](int begin, int end) {
+        vector<double> cr(mh), ci(mh);
+        for (int i = (begin + mh - 1) / mh; i * mh < end; i++) {
+            for (int j = 0; j < mh; j++) {
+                cr[j] = re[long(j) * mw + i];
+                ci[j] = im[long(j) * mw + i];
+            }
+            fft(cr.data(), ci.data(), mh, inverse);
+            for (int j = 0; j < mh; j++) {
+                re[long(j) * mw + i] = cr[j];
+                im[long(j) * mw + i] = ci[j];
+            }
+        }
+    });
+}
+
+//
+// Forces: The accelerations of the atoms due to the force stages, which are
+// computed by accelerate() from the positions of the atoms.
+//
+template <class Real>
+struct Forces {
+    bool active;           // whether any force stage is enabled
+    vector<Real> ax, ay;   // acceleration of each atom
+    Grid<> neighbors;      // candidate pairs of the pair potential
+    vector<Real> fx, fy;   // pair forces accumulated by each worker
+    double maxStep;        // largest stable time step (0 = no limit)
+    Tree tree;             // Barnes-Hut tree of the long-range interaction
+    Mesh mesh;             // grids of the particle-mesh solver
+};
+
+//
+// LennardJones, WCA, Yukawa: The pair potentials; force(r2, sigma, eps) returns
+// the magnitude of the force between two atoms at distance r = sqrt(r2) divided
+// by r, such that the force on the second atom is force * (separation vector),
+// for the energy scale eps of their species.
+//
+struct LennardJones {
+    static constexpr double cutoff = 2.5;
+
+    template <class Real>
+    static Real force(Real r2, Real sigma, double eps) {
+        Real s2 = sigma * sigma / r2;
+        Real s6 = s2 * s2 * s2;
+        return Real(24 * eps) * (2 * s6 * s6 - s6) / r2;
+    }
+};
+
+struct WCA {
+    static constexpr double cutoff = 1.122462048309373;  // 2^(1/6)
+
+    template <class Real>
+    static Real force(Real r2, Real sigma, double eps) {
+        return LennardJones::force(r2, sigma, eps);
+    }
+};
+
+struct Yukawa {
+    static constexpr double cutoff = 3.0;
+
+    template <class Real>
+    static Real force(Real r2, Real sigma, double eps) {
+        Real r = sqrt(r2);
+        Real u = Real(eps) * sigma / r * exp(-Real(kappa) * (r / sigma - 1));
+        return u * (1 / r + Real(kappa) / sigma) / r;
+    }
+};
+
+//
+// pairForces: Adds the accelerations due to the pair potential to the ones in
+// forces. The candidate pairs come from a grid whose cells are as wide as the
+// largest cutoff distance, and each pair is visited once, applying equal and
+// opposite forces to both atoms. Every worker takes a contiguous range of the
+// atoms sorted by cell and accumulates its forces into private arrays, which
+// are then summed per atom in parallel, so the workers never contend.
+//
+template <class Boundary, class Potential, class Real>
+void pairForces(int n, Atom<Real> atoms[], Forces<Real>& forces) {
+    const Real rc = static_cast<Real>(cutoff > 0 && !is_same<Potential, WCA>::value ? cutoff : Potential::cutoff);
+    Real reach = 0;
+    for (int i = 0; i < n; i++)
+        reach = max(reach, 2 * rc * atoms[i].r);
+    Grid<>& grid = forces.neighbors;
+    grid.build<Boundary>(n, atoms, reach);
+
+    const int t = workers(n);
+    forces.fx.assign(static_cast<size_t>(t) * n, 0);
+    forces.fy.assign(static_cast<size_t>(t) * n, 0);
+    parallelFor(n, [&](int begin, int end, int w) {
+        Real* fx = &forces.fx[static_cast<size_t>(w) * n];
+        Real* fy = &forces.fy[static_cast<size_t>(w) * n];
+        for (int a = begin; a < end; a++) {
+            grid.pairsOf<Boundary>(a, [&](int i, int j) {
+                Real dx = atoms[j].x - atoms[i].x;
+                Real dy = atoms[j].y - atoms[i].y;
+                Boundary::separation(dx, dy);
+                Real sigma = atoms[i].r + atoms[j].r;
+                Real r2 = dx * dx + dy * dy;
+                if (r2 < rc * rc * sigma * sigma && r2 > 0) {
+                    Real f = Potential::force(r2, sigma, interactionOf(i, j).epsilon);
+                    fx[i] -= f * dx;
+                    fy[i] -= f * dy;
+                    fx[j] += f * dx;
+                    fy[j] += f * dy;
+                }
+            });
+        }
+    });
+    Real* ax = forces.ax.data();
+    Real* ay = forces.ay.data();
+    parallelFor(n, [&](int begin, int end) {
+        for (int w = 0; w < t; w++) {
+            const Real* fx = &forces.fx[static_cast<size_t>(w) * n];
+            const Real* fy = &forces.fy[static_cast<size_t>(w) * n];
+            for (int i = begin; i < end; i++) {
+                Real m = atoms[i].r * atoms[i].r * static_cast<Real>(densityOf(i));
+                ax[i] += fx[i] / m;
+                ay[i] += fy[i] / m;
+            }
+        }
+    });
+}
+
+//
+// treeForces: Adds the accelerations due to the long-range interaction to the
+// ones in forces, walking the Barnes-Hut tree once for every atom. The atoms
+// are taken in Morton order, so that consecutive atoms open similar nodes, and
+// the whole walk of an atom is done by one worker without sharing anything.
+// A node far enough is taken as its monopole, plus with Quadrupole the term
+// -conj(Q/z^3) of its complex quadrupole moment Q at the offset z of the atom,
+// with 1/z softened to conj(z)/(|z|^2 + SOFTENING^2) as in the monopole term.
+//
+template <bool Quadrupole, class Real>
+void treeForces(int n, Atom<Real> atoms[], Forces<Real>& forces) {
+    Tree& tree = forces.tree;
+    tree.build(n, atoms);
+    const double s2 = SOFTENING * SOFTENING;
+    const double t2 = theta * theta;
+    const double k = longRange == LONGRANGE_GRAVITY ? coupling : -coupling;
+    Real* ax = forces.ax.data();
+    Real* ay = forces.ay.data();
+    parallelFor(n, [&](int begin, int end) {
+        int stack[4 * DEPTH + 4];
+        for (int a = begin; a < end; a++) {
+            double x = tree.px[a], y = tree.py[a];
+            double gx = 0, gy = 0;
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                const Tree::Node& node = tree.nodes[stack[--top]];
+                double dx = node.x - x, dy = node.y - y;
+                double d2 = dx * dx + dy * dy;
+                if (node.child < 0) {
+                    // the atom itself adds nothing, being at distance 0
+                    for (int b = node.begin; b < node.end; b++) {
+                        double ex = tree.px[b] - x, ey = tree.py[b] - y;
+                        double f = tree.pm[b] / (ex * ex + ey * ey + s2);
+                        gx += f * ex;
+                        gy += f * ey;
+                    }
+                }
+                else if (node.size * node.size < t2 * d2) {
+                    double f = node.m / (d2 + s2);
+                    gx += f * dx;
+                    gy += f * dy;
+                    if (Quadrupole) {
+                        double e2 = d2 + s2;
+                        double ux = -dx / e2, uy = dy / e2;   // 1/z, softened like the monopole
+                        double vx = ux * ux - uy * uy, vy = 2 * ux * uy;
+                        double wx = vx * ux - vy * uy, wy = vx * uy + vy * ux;
+                        gx -= node.qr * wx - node.qi * wy;
+                        gy += node.qr * wy + node.qi * wx;
+                    }
+                }
+                else {
+                    for (int c = node.child; c < node.child + node.children; c++)
+                        stack[top++] = c;
+                }
+            }
+            double response = k * responseOf(tree.order[a]);
+            ax[tree.order[a]] += static_cast<Real>(response * gx);
+            ay[tree.order[a]] += static_cast<Real>(response * gy);
+        }
+    });
+}
+
+//
+// cic: Finds the four cells of the mesh nearest to the point (x, y) of the
+// periodic box, as the indices i0, i1 of their columns and j0, j1 of their
+// rows, and the cloud-in-cell weight fx, fy of the second column and row.
+//
+inline void cic(const Mesh& mesh, double x, double y, int& i0, int& i1, int& j0, int& j1,
+                double& fx, double& fy) {
+    double u = x * mesh.mw / W - 0.5;
+    double v = y * mesh.mh / H - 0.5;
+    double fu = floor(u), fv = floor(v);
+    fx = u - fu;
+    fy = v - fv;
+    i0 = ((static_cast<int>(fu) % mesh.mw) + mesh.mw) % mesh.mw;
+    j0 = ((static_cast<int>(fv) % mesh.mh) + mesh.mh) % mesh.mh;
+    i1 = i0 + 1 < mesh.mw ? i0 + 1 : 0;
+    j1 = j0 + 1 < mesh.mh ? j0 + 1 : 0;
+}
+
+//
+// meshForces: Adds the accelerations due to the long-range interaction in the
+// periodic box to the ones in forces, by the particle-mesh method: the masses
+// are deposited on the mesh with cloud-in-cell weights, Poisson's equation is
+// solved in Fourier space, where the field of the log potential of the plane
+// is 2*pi*i*k*rho(k)/|k|^2 (the mean k = 0 being dropped), and the field is
+// interpolated back to the atoms with the same weights. The cost is O(n) for
+// the atoms and O(M log M) for the M cells of the mesh.
+//
+template <class Real>
+void meshForces(int n, Atom<Real> atoms[], Forces<Real>& forces) {
+    Mesh& mesh = forces.mesh;
+    const int mw = mesh.mw = meshSize;
+    const int mh = mesh.mh = meshSize;
+    const int m = mw * mh;
+    const int t = workers(n);
+    const double area = double(W) * H / m;
+
+    mesh.rho.assign(static_cast<size_t>(t) * m, 0);
+    parallelFor(n, [&](int begin, int end, int w) {
+        double* rho = &mesh.rho[static_cast<size_t>(w) * m];
+        for (int i = begin; i < end; i++) {
+            int i0, i1, j0, j1;
+            double fx, fy;
+            cic(mesh, atoms[i].x, atoms[i].y, i0, i1, j0, j1, fx, fy);
+            double q = chargeOf(atoms[i], i) / area;
+            rho[j0 * mw + i0] += q * (1 - fx) * (1 - fy);
+            rho[j0 * mw + i1] += q * fx * (1 - fy);
+            rho[j1 * mw + i0] += q * (1 - fx) * fy;
+            rho[j1 * mw + i1] += q * fx * fy;
+        }
+    });
+    mesh.re.resize(m);
+    mesh.im.resize(m);
+    parallelFor(m, [&](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            double sum = 0;
+            for (int w = 0; w < t; w++)
+                sum += mesh.rho[static_cast<size_t>(w) * m + c];
+            mesh.re[c] = sum;
+            mesh.im[c] = 0;
+        }
+    });
+
+    // the field (sx, sy) is real, so it is transformed back as sx + i*sy
+    double* re = mesh.re.data();
+    double* im = mesh.im.data();
+    fft2(re, im, mw, mh, false);
+    parallelFor(m, [&](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            int i = c % mw, j = c / mw;
+            double kx = (i == mw / 2) ? 0 : 2 * PI * (i < mw / 2 ? i : i - mw) / W;
+            double ky = (j == mh / 2) ? 0 : 2 * PI * (j < mh / 2 ? j : j - mh) / H;
+            double k2 = kx * kx + ky * ky;
+            double g = k2 > 0 ? 2 * PI / k2 / m : 0;
+            // sx = g*kx*i*rho and sy = g*ky*i*rho, then sx + i*sy
+            double ar = -im[c] * g, ai = re[c] * g;   // g*i*rho
+            re[c] = kx * ar - ky * ai;
+            im[c] = kx * ai + ky * ar;
+        }
+    });
+    fft2(re, im, mw, mh, true);
+
+    const double k = longRange == LONGRANGE_GRAVITY ? coupling : -coupling;
+    Real* ax = forces.ax.data();
+    Real* ay = forces.ay.data();
+    parallelFor(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int i0, i1, j0, j1;
+            double fx, fy;
+            cic(mesh, atoms[i].x, atoms[i].y, i0, i1, j0, j1, fx, fy);
+            double w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+            double response = k * responseOf(i);
+            ax[i] += static_cast<Real>(response * (w00 * re[j0 * mw + i0] + w10 * re[j0 * mw + i1]
+                                            + w01 * re[j1 * mw + i0] + w11 * re[j1 * mw + i1]));
+            ay[i] += static_cast<Real>(response * (w00 * im[j0 * mw + i0] + w10 * im[j0 * mw + i1]
+                                            + w01 * im[j1 * mw + i0] + w11 * im[j1 * mw + i1]));
+        }
+    });
+}
+
+//
+// accelerate: Computes the accelerations of the atoms due to the external
+// fields, the pair potential and the long-range interaction. Each field is
+// added in a parallel loop of its own without branches, so the configuration
+// is checked once per step and not once per atom. The positions of
+// FIELD_BLOCK atoms at a time are gathered into arrays first, so that the
+// loops over them vectorize (the central force if the square root need not
+// set errno, -fno-math-errno; the sampled field with gathers from its cells).
+//
+template <class Boundary, class Real>
+void accelerate(int n, Atom<Real> atoms[], Forces<Real>& forces) {
+    forces.ax.assign(n, static_cast<Real>(field.gravity ? field.gx : 0));
+    forces.ay.assign(n, static_cast<Real>(field.gravity ? field.gy : 0));
+    Real* ax = forces.ax.data();
+    Real* ay = forces.ay.data();
+
+    if (field.central) {
+        const Real cx = static_cast<Real>(field.cx);
+        const Real cy = static_cast<Real>(field.cy);
+        const Real k = static_cast<Real>(field.k);
+        const Real s2 = static_cast<Real>(SOFTENING * SOFTENING);
+        parallelFor(n, [&](int begin, int end) {
+            Real px[FIELD_BLOCK], py[FIELD_BLOCK];
+            for (int b = begin; b < end; b += FIELD_BLOCK) {
+                const int m = min(FIELD_BLOCK, end - b);
+                for (int j = 0; j < m; j++) {
+                    px[j] = atoms[b + j].x;
+                    py[j] = atoms[b + j].y;
+                }
+                Real* __restrict fx = ax + b;
+                Real* __restrict fy = ay + b;
+                for (int j = 0; j < m; j++) {
+                    Real dx = cx - px[j];
+                    Real dy = cy - py[j];
+                    Real d2 = dx * dx + dy * dy + s2;
+                    Real f = k / (d2 * sqrt(d2));
+                    fx[j] += f * dx;
+                    fy[j] += f * dy;
+                }
+            }
+        });
+    }
+
+    if (field.fw > 0) {
+        // bilinear interpolation between the cell centers, constant beyond them
+        const int fw = field.fw, fh = field.fh;
+        const double* fx = field.fx.data();
+        const double* fy = field.fy.data();
+        const Real sx = Real(fw) / W, sy = Real(fh) / H;
+        const int iMax = max(fw - 2, 0), jMax = max(fh - 2, 0);
+        parallelFor(n, [&](int begin, int end) {
+            Real px[FIELD_BLOCK], py[FIELD_BLOCK];
+            for (int b = begin; b < end; b += FIELD_BLOCK) {
+                const int m = min(FIELD_BLOCK, end - b);
+                for (int j = 0; j < m; j++) {
+                    px[j] = atoms[b + j].x;
+                    py[j] = atoms[b + j].y;
+                }
+                Real* __restrict gx = ax + b;
+                Real* __restrict gy = ay + b;
+                for (int j = 0; j < m; j++) {
+                    Real u = min(max(px[j] * sx - Real(0.5), Real(0)), Real(fw - 1));
+                    Real v = min(max(py[j] * sy - Real(0.5), Real(0)), Real(fh - 1));
+                    int i0 = min(static_cast<int>(u), iMax);
+                    int j0 = min(static_cast<int>(v), jMax);
+                    int i1 = min(i0 + 1, fw - 1);
+                    int j1 = min(j0 + 1, fh - 1);
+                    Real tu = u - i0, tv = v - j0;
+                    Real w00 = (1 - tu) * (1 - tv), w10 = tu * (1 - tv);
+                    Real w01 = (1 - tu) * tv, w11 = tu * tv;
+                    gx[j] += static_cast<Real>(w00 * fx[j0 * fw + i0] + w10 * fx[j0 * fw + i1]
+                                               + w01 * fx[j1 * fw + i0] + w11 * fx[j1 * fw + i1]);
+                    gy[j] += static_cast<Real>(w00 * fy[j0 * fw + i0] + w10 * fy[j0 * fw + i1]
+                                               + w01 * fy[j1 * fw + i0] + w11 * fy[j1 * fw + i1]);
+                }
+            }
+        });
+    }
+
+    switch (potential) {
+    case POTENTIAL_LJ: pairForces<Boundary, LennardJones>(n, atoms, forces); break;
+    case POTENTIAL_WCA: pairForces<Boundary, WCA>(n, atoms, forces); break;
+    case POTENTIAL_YUKAWA: pairForces<Boundary, Yukawa>(n, atoms, forces); break;
+    case POTENTIAL_HARD: break;
+    }
+
+    if (longRange != LONGRANGE_NONE) {
+        if (solver == SOLVER_MESH)
+            meshForces(n, atoms, forces);
+        else if (quadrupole)
+            treeForces<true>(n, atoms, forces);
+        else
+            treeForces<false>(n, atoms, forces);
+    }
+}
+
+// The force stages act in the plane only, and a 3D run has none of them.
+template <class Boundary, class Real>
+void accelerate(int, Atom<Real, 3>[], Forces<Real>&) {
+}
+
+//
+// startForces: Enables the force stages selected by the options and computes
+// the initial accelerations of the atoms. A -dt coarser than the largest
+// stable time step of the potential is an error; without -dt, the number of
+// steps per frame needed for it is taken, but no more than MAX_STEPS.
+//
+template <class Boundary, class Real, int D>
+void startForces(int n, Atom<Real, D> atoms[], Forces<Real>& forces) {
+    forces.active = field.gravity || field.central || field.fw > 0 || potential != POTENTIAL_HARD
+        || longRange != LONGRANGE_NONE;
+    // the steep core of a potential must be resolved by about a hundred steps
+    // of its time scale sigma*sqrt(m/epsilon) = 2*r*r*sqrt(density/epsilon),
+    // for the lightest atom and the strongest pair of species
+    forces.maxStep = 0;
+    if (potential != POTENTIAL_HARD && n > 0) {
+        double scale = HUGE_VAL;
+        for (int i = 0; i < n; i++)
+            scale = min(scale, double(atoms[i].r) * atoms[i].r * sqrt(densityOf(i)));
+        double eps = 0;
+        for (const Interaction& pair : interactions)
+            eps = max(eps, pair.epsilon);
+        forces.maxStep = 0.02 * scale / sqrt(eps);
+    }
+    if (timeStep > 0 && forces.maxStep > 0 && timeStep > forces.maxStep) {
+        cerr << "Error: -dt=" << timeStep << " is coarser than the largest stable time step "
+            << forces.maxStep << " of the potential" << endl;
+        exit(1);
+    }
+    if (timeStep == 0 && forces.maxStep > 0 && ceil(1 / forces.maxStep) > MAX_STEPS)
+        cerr << "Warning: The potential needs time steps of " << forces.maxStep << ", but only "
+            << MAX_STEPS << " steps per frame are taken" << endl;
+    if (forces.active)
+        accelerate<Boundary>(n, atoms, forces);
+}
+
+//
+// kick: Changes the velocities of the atoms by their accelerations over time h.
+//
+template <class Real, int D>
+void kick(int n, Atom<Real, D> atoms[], const Forces<Real>& forces, Real h) {
+    const Real* ax = forces.ax.data();
+    const Real* ay = forces.ay.data();
+    for (int i = 0; i < n; i++) {
+        atoms[i].vx += ax[i] * h;
+        atoms[i].vy += ay[i] * h;
+    }
+}
+
+//
+// drift: Moves an atom along its velocity for the time dt.
+//
+template <class Real>
+inline void drift(Atom<Real>& atom, Real dt) {
+    atom.x += atom.vx * dt;
+    atom.y += atom.vy * dt;
+}
+
+template <class Real>
+inline void drift(Atom<Real, 3>& atom, Real dt) {
+    atom.x += atom.vx * dt;
+    atom.y += atom.vy * dt;
+    atom.z += atom.vz * dt;
+}
+
+//
+// bounce: Moves an atom that overlaps an obstacle at the point (px, py) of its
+// surface with the outward normal (nx, ny) out along the normal until it just
+// touches, and reflects its velocity along the normal with the coefficient of
+// restitution e if it approaches.
+//
+template <class Real>
+inline void bounce(Atom<Real>& atom, double px, double py, double nx, double ny, double e) {
+    atom.x = static_cast<Real>(px + nx * atom.r);
+    atom.y = static_cast<Real>(py + ny * atom.r);
+    double vn = atom.vx * nx + atom.vy * ny;
+    if (vn < 0) {
+        atom.vx -= static_cast<Real>((1 + e) * vn * nx);
+        atom.vy -= static_cast<Real>((1 + e) * vn * ny);
+    }
+}
+
+//
+// closest: Finds the point (px, py) of segment k of the scene closest to the
+// point (x, y), and returns the squared distance between them.
+//
+inline double closest(int k, double x, double y, double& px, double& py) {
+    double ex = scene.x1[k] - scene.x0[k], ey = scene.y1[k] - scene.y0[k];
+    double e2 = ex * ex + ey * ey;
+    double t = e2 > 0 ? ((x - scene.x0[k]) * ex + (y - scene.y0[k]) * ey) / e2 : 0;
+    t = min(max(t, 0.0), 1.0);
+    px = scene.x0[k] + t * ex;
+    py = scene.y0[k] + t * ey;
+    return (x - px) * (x - px) + (y - py) * (y - py);
+}
+
+//
+// obstacles: Bounces the atoms off the obstacles of the scene, testing each
+// atom against the obstacles listed in the cell of its center. An edge of a
+// polygon only bounces atoms whose center is on its outer side; an atom whose
+// center is inside a polygon (by the crossing number of its edges) is moved
+// out along the normal of the nearest edge. An atom whose center lies on a
+// segment is moved back to the side it came from, and one at the center of a
+// disc back against its velocity.
+//
+template <class Real>
+void obstacles(int n, Atom<Real> atoms[]) {
+    const int segments = static_cast<int>(scene.x0.size());
+    const int discs = static_cast<int>(scene.cx.size());
+    parallelFor(n, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Atom<Real>& atom = atoms[i];
+            int cx = min(max(static_cast<int>(atom.x / scene.cell), 0), scene.gw - 1);
+            int cy = min(max(static_cast<int>(atom.y / scene.cell), 0), scene.gh - 1);
+            int c = cy * scene.gw + cx;
+            for (int b = scene.start[c]; b < scene.start[c + 1]; b++) {
+                int k = scene.items[b];
+                if (k < segments) {
+                    double px, py;
+                    double d2 = closest(k, atom.x, atom.y, px, py);
+                    if (d2 >= double(atom.r) * atom.r)
+                        continue;
+                    double dx = atom.x - px, dy = atom.y - py;
+                    double d = sqrt(d2);
+                    double nx = scene.nx[k], ny = scene.ny[k];
+                    if (nx != 0 || ny != 0) {
+                        // the inside of a polygon is handled with the polygon
+                        if (dx * nx + dy * ny < 0)
+                            continue;
+                    }
+                    else if (d == 0) {
+                        double ex = scene.x1[k] - scene.x0[k], ey = scene.y1[k] - scene.y0[k];
+                        double e = hypot(ex, ey);
+                        if (e == 0)
+                            continue;
+                        nx = atom.vx * ey - atom.vy * ex > 0 ? -ey / e : ey / e;
+                        ny = atom.vx * ey - atom.vy * ex > 0 ? ex / e : -ex / e;
+                    }
+                    if (d > 0) {
+                        nx = dx / d;
+                        ny = dy / d;
+                    }
+                    bounce(atom, px, py, nx, ny, speciesOf(i).restitution);
+                }
+                else if (k < segments + discs) {
+                    k -= segments;
+                    double dx = atom.x - scene.cx[k], dy = atom.y - scene.cy[k];
+                    double d = sqrt(dx * dx + dy * dy);
+                    if (d >= scene.cr[k] + atom.r)
+                        continue;
+                    if (d == 0) {
+                        double v = hypot(atom.vx, atom.vy);
+                        dx = v > 0 ? -atom.vx / v : 1;
+                        dy = v > 0 ? -atom.vy / v : 0;
+                        d = 1;
+                    }
+                    bounce(atom, scene.cx[k] + dx / d * scene.cr[k], scene.cy[k] + dy / d * scene.cr[k],
+                           dx / d, dy / d, speciesOf(i).restitution);
+                }
+                else {
+                    k -= segments + discs;
+                    bool inside = false;
+                    for (int e = scene.first[k]; e < scene.last[k]; e++) {
+                        double y0 = scene.y0[e], y1 = scene.y1[e];
+                        if ((y0 > atom.y) != (y1 > atom.y)
+                            && atom.x < scene.x0[e] + (atom.y - y0) * (scene.x1[e] - scene.x0[e]) / (y1 - y0))
+                            inside = !inside;
+                    }
+                    if (!inside)
+                        continue;
+                    int nearest = scene.first[k];
+                    double best = HUGE_VAL, px = 0, py = 0;
+                    for (int e = scene.first[k]; e < scene.last[k]; e++) {
+                        double qx, qy;
+                        double d2 = closest(e, atom.x, atom.y, qx, qy);
+                        if (d2 < best && (scene.nx[e] != 0 || scene.ny[e] != 0)) {
+                            best = d2;
+                            nearest = e;
+                            px = qx;
+                            py = qy;
+                        }
+                    }
+                    bounce(atom, px, py, scene.nx[nearest], scene.ny[nearest], speciesOf(i).restitution);
+                }
+            }
+        }
+    });
+}
+
+// Obstacles are planar, and options() rejects them in 3D.
+template <class Real>
+void obstacles(int, Atom<Real, 3>[]) {
+}
+
+//
+// collide: Checks whether atoms i and j overlap and if so, repositions atom j
+// so that the two atoms just touch and lets the collision model update their
+// velocities.
+//
+template <class Boundary, class Collision, class Real>
+inline void collide(Atom<Real> atoms[], int i, int j, Collision& collision) {
+    Real dx = atoms[j].x - atoms[i].x;
+    Real dy = atoms[j].y - atoms[i].y;
+    Boundary::separation(dx, dy);
+    Real sumR = atoms[i].r + atoms[j].r;
+    if (dx * dx + dy * dy < sumR * sumR) {
+        // Reposition atom j so that the two atoms just touch
+        Real dist = sqrt(dx * dx + dy * dy);
+        Real overlap = sumR - dist;
+        Real norm = (dist == 0) ? 1 : dist;
+        atoms[j].x += (dx / norm) * overlap;
+        atoms[j].y += (dy / norm) * overlap;
+
+        collision.contact(atoms, i, j, dx, dy);
+    }
+}
+
+template <class Boundary, class Collision, class Real>
+inline void collide(Atom<Real, 3> atoms[], int i, int j, Collision& collision) {
+    Real dx = atoms[j].x - atoms[i].x;
+    Real dy = atoms[j].y - atoms[i].y;
+    Real dz = atoms[j].z - atoms[i].z;
+    Boundary::separation(dx, dy, dz);
+    Real sumR = atoms[i].r + atoms[j].r;
+    if (dx * dx + dy * dy + dz * dz < sumR * sumR) {
+        Real dist = sqrt(dx * dx + dy * dy + dz * dz);
+        Real overlap = sumR - dist;
+        Real norm = (dist == 0) ? 1 : dist;
+        atoms[j].x += (dx / norm) * overlap;
+        atoms[j].y += (dy / norm) * overlap;
+        atoms[j].z += (dz / norm) * overlap;
+
+        collision.contact(atoms, i, j, dx, dy, dz);
+    }
+}
+
+//
+// update: Advances the atoms by the time step dt (1.0 is one frame at the nominal
+// rate), handles collisions with the boundary of the box and with the obstacles
+// and then detects and resolves collisions between atoms.
+// If force stages are active, the step is one of the velocity Verlet (leapfrog
+// kick-drift-kick) integrator: half a kick with the accelerations at the old
+// positions before the positions are updated, and half a kick with those at the
+// new positions after the collisions are resolved.
+// The atom–atom collisions are handled by collide().
+//
+template <class Boundary, class Broadphase, class Collision, class Real, int D>
+void update(int n, Atom<Real, D> atoms[], Real dt, Broadphase& broadphase, Collision& collision,
+            Forces<Real>& forces) {
+    if (forces.active)
+        kick(n, atoms, forces, dt / 2);
+
+    // Update positions and boundary collisions
+    Boundary::advance(dt);
+    for (int i = 0; i < n; i++) {
+        drift(atoms[i], dt);
+        Boundary::move(atoms[i], i);
+    }
+    if (!scene.start.empty())
+        obstacles(n, atoms);
+
+    // Check collisions between the candidate pairs of atoms
+    broadphase.template pairs<Boundary>(n, atoms, [atoms, &collision](int i, int j) {
+        collide<Boundary>(atoms, i, j, collision);
+    });
+    collision.finish(atoms);
+
+    if (forces.active) {
+        accelerate<Boundary>(n, atoms, forces);
+        kick(n, atoms, forces, dt / 2);
+    }
+}
+
+//
+// Pacer: Frame scheduler that targets a fixed frame period against absolute
+// steady_clock deadlines, so the time spent in update() and draw() does not add
+// to the period. The number of physics steps per frame adapts to the measured
+// cost of a step: spare time is spent on more (and smaller) steps, while a
+// missed deadline reduces them.
+//
+struct Pacer {
+    chrono::steady_clock::duration period;
+    chrono::steady_clock::time_point deadline; // end of the current frame
+    int steps;        // physics steps to take in the current frame
+    int frames;       // number of frames paced so far
+    int missed;       // number of frames that finished after their deadline
+    long totalSteps;  // number of physics steps taken so far
+    chrono::steady_clock::duration worstLate;  // largest deadline overrun
+};
+
+//
+// startPacing: Starts pacing frames of the given period (in milliseconds);
+// the first frame ends one period from now.
+//
+void startPacing(Pacer& pacer, int period) {
+    pacer.period = chrono::milliseconds(period);
+    pacer.deadline = chrono::steady_clock::now() + pacer.period;
+    pacer.steps = 1;
+    pacer.frames = 0;
+    pacer.missed = 0;
+    pacer.totalSteps = 0;
+    pacer.worstLate = chrono::steady_clock::duration::zero();
+}
+
+//
+// pace: Ends the current frame, given the time spent on its physics steps and
+// on drawing. Chooses the number of steps for the next frame such that about
+// three quarters of the time left after drawing is used for physics (at most
+// doubling or halving per frame), then waits for the deadline. A frame that
+// finishes late is counted as missed; if it is late by more than a whole
+// period, the schedule is restarted from now instead of rushing to catch up.
+//
+void pace(Pacer& pacer, chrono::steady_clock::duration stepTime,
+          chrono::steady_clock::duration drawTime) {
+    pacer.frames++;
+    pacer.totalSteps += pacer.steps;
+
+    double step = chrono::duration<double>(stepTime).count() / pacer.steps;
+    double budget = 0.75 * chrono::duration<double>(pacer.period - drawTime).count();
+    int steps = (step > 0) ? static_cast<int>(min(budget / step, double(MAX_STEPS))) : MAX_STEPS;
+    steps = max(steps, pacer.steps / 2);
+    steps = min(steps, pacer.steps * 2);
+    pacer.steps = max(1, min(steps, MAX_STEPS));
+
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now > pacer.deadline) {
+        chrono::steady_clock::duration late = now - pacer.deadline;
+        pacer.missed++;
+        pacer.worstLate = max(pacer.worstLate, late);
+        pacer.steps = max(1, pacer.steps / 2);
+        if (late > pacer.period)
+            pacer.deadline = now;
+    }
+    else {
+        this_thread::sleep_until(pacer.deadline);
+    }
+    pacer.deadline += pacer.period;
+}
+
+//
+// report: Prints the frame statistics collected by the pacer, and how the
+// frames were presented in the window, with their latency.
+//
+void report(const Pacer& pacer, const Presentation& presentation) {
+    cout << "Frames: " << pacer.frames
+        << ", missed deadlines: " << pacer.missed;
+    if (pacer.missed > 0)
+        cout << " (worst " << chrono::duration<double, milli>(pacer.worstLate).count() << " ms late)";
+    cout << ", physics steps per frame: "
+        << (pacer.frames > 0 ? double(pacer.totalSteps) / pacer.frames : 0.0) << endl;
+    cout << "Presentation: " << (presentation.shm ? "MIT-SHM" : "XPutImage")
+        << ", frames: " << presentation.frames
+        << ", latency: last " << presentation.latency
+        << " ms, mean " << presentation.meanLatency
+        << " ms, max " << presentation.maxLatency << " ms" << endl;
+}
+
+//
+// Writer: Background task that saves thumbnails, so that the simulation only
+// has to draw a thumbnail on an off-screen surface and hand it over. The task
+// is spawned on the scheduler when a thumbnail is queued and none is running,
+// and ends once the queue is empty. At most QUEUE_MAX thumbnails are waiting;
+// if the queue is full, the simulation waits for the writer (counted in
+// stalls).
+//
+struct Thumbnail {
+    Surface* surface;
+    string filename;
+};
+
+struct Writer {
+    Tasks tasks;
+    mutex lock;
+    condition_variable changed;
+    deque<Thumbnail> queue;
+    bool writing;  // whether the task is running
+    long written;  // number of thumbnails written
+    long failed;   // number of thumbnails that could not be written
+    long stalls;   // number of times the simulation waited for a full queue
+};
+
+//
+// writeThumbnails: Body of the writer task; saves and releases the queued
+// thumbnails until the queue is empty.
+//
+void writeThumbnails(Writer& writer) {
+    unique_lock<mutex> lock(writer.lock);
+    while (!writer.queue.empty()) {
+        Thumbnail thumbnail = writer.queue.front();
+        writer.queue.pop_front();
+        writer.changed.notify_all();
+        lock.unlock();
+        bool ok = thumbnail.surface->save(thumbnail.filename.c_str());
+        delete thumbnail.surface;
+        if (!ok)
+            cerr << "Error: Cannot write file " << thumbnail.filename << endl;
+        lock.lock();
+        if (ok) writer.written++;
+        else writer.failed++;
+    }
+    writer.writing = false;
+}
+
+//
+// startWriter: Starts the writer, without a task as yet.
+//
+void startWriter(Writer& writer) {
+    writer.writing = false;
+    writer.written = 0;
+    writer.failed = 0;
+    writer.stalls = 0;
+}
+
+//
+// submit: Queues the thumbnail surface to be saved to filename, spawning the
+// writer task unless it is running; the writer takes over the surface.
+//
+void submit(Writer& writer, Surface* surface, const string& filename) {
+    unique_lock<mutex> lock(writer.lock);
+    if (writer.queue.size() >= QUEUE_MAX) {
+        writer.stalls++;
+        writer.changed.wait(lock, [&] { return writer.queue.size() < QUEUE_MAX; });
+    }
+    writer.queue.push_back({ surface, filename });
+    writer.changed.notify_all();
+    if (!writer.writing) {
+        writer.writing = true;
+        scheduler().spawn(writer.tasks, PRIORITY_LOW, [&writer] { writeThumbnails(writer); });
+    }
+}
+
+//
+// stopWriter: Waits until all queued thumbnails are written and prints the
+// statistics of the writer.
+//
+void stopWriter(Writer& writer) {
+    scheduler().wait(writer.tasks);
+    cout << "Thumbnails written: " << writer.written
+        << ", failed: " << writer.failed
+        << ", stalls: " << writer.stalls << endl;
+}
+
+//
+// framed: Inserts the frame number into the given file name before its
+// extension.
+//
+string framed(const string& name, int frame) {
+    char number[16];
+    snprintf(number, sizeof(number), "-%06d", frame);
+    string filename = name;
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        dot = filename.size();
+    filename.insert(dot, number);
+    return filename;
+}
+
+//
+// thumbnail: Draws the atoms on a new off-screen surface of size TW*TH and
+// hands it to the writer under the thumbnail file name for the given frame.
+//
+template <class Real, int D>
+void thumbnail(Writer& writer, int frame, int n, Atom<Real, D> atoms[]) {
+    Surface* surface = new Surface(TW, TH);
+    draw(*surface, n, atoms);
+    submit(writer, surface, framed(thumbFile, frame));
+}
+
+//
+// Dumper: Background writer of the snapshots, so that the simulation only
+// encodes the atoms into a free buffer and hands it over. There are
+// dumpBuffers buffers (by default two, one being filled while the other is
+// written); if none is free, the simulation waits for the dumper (counted in
+// stalls, along with the time waited). Each snapshot goes to a file of its
+// own, or all of them to consecutive places of the trajectory file, written
+// - by DUMP_WRITE with one write() per snapshot in a task of its own,
+// - by DUMP_WRITEV like DUMP_WRITE, except that all the snapshots waiting for
+//   the trajectory are written with one writev(),
+// - by DUMP_URING through an io_uring in a task of its own: the buffers are
+//   registered with the ring once, and all the snapshots waiting are
+//   submitted in one call, as writes from the registered buffers; where the
+//   kernel has no io_uring, the dumper falls back to DUMP_POOL,
+// - by DUMP_POOL with one write() per snapshot in up to DUMP_THREADS tasks,
+//   so that several files are written at the same time.
+// The tasks are spawned on the scheduler as snapshots are queued, and end
+// once the queue is empty.
+// With dumpDirect, the files are opened with O_DIRECT, bypassing the page
+// cache, and written in whole blocks of DIRECT_ALIGN bytes from aligned
+// buffers, without changing their contents: a file of its own is padded with
+// zeros and cut back to its size; in the trajectory, each snapshot is written
+// up to its last whole block, led by the end of the previous snapshot in the
+// block where it starts (kept in carry), and stopDumper() writes the last,
+// partial block padded and cuts the file back. On a file system without
+// O_DIRECT, the dumper writes through the page cache.
+//
+struct Dump {
+    unsigned char* data;   // the lead, the header followed by the atoms, then the padding
+    size_t size;           // size of the snapshot
+    size_t capacity;       // size of data, a multiple of DIRECT_ALIGN
+    size_t lead;           // bytes of the previous snapshot before it in data
+    size_t length;         // bytes of data to write
+    off_t offset;          // place of data in its file
+    string filename;
+};
+
+//
+// Ring: An io_uring, with its submission and completion queues mapped into
+// memory; only one task at a time submits and reaps.
+//
+struct Ring {
+    int fd;
+    unsigned entries;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    void* sqRing;
+    void* cqRing;
+    size_t sqBytes, cqBytes, sqeBytes;
+};
+
+struct Dumper {
+    Tasks tasks;
+    mutex lock;
+    condition_variable changed;
+    vector<Dump> buffers;
+    deque<int> queue;      // buffers waiting to be written
+    vector<int> free;      // buffers free to be filled
+    int writers;           // number of tasks running
+    DumpMode mode;         // dumpMode, unless the dumper fell back
+    Ring ring;
+    int trajectory;        // file descriptor of the trajectory file, or -1
+    off_t next;            // place of the next snapshot in the trajectory
+    vector<unsigned char> carry;   // its last, partial block written with O_DIRECT
+    atomic<bool> direct;   // whether the files are written with O_DIRECT
+    long written;          // number of snapshots written
+    long failed;           // number of snapshots that could not be written
+    long calls;            // number of write (or submit) calls
+    long stalls;           // number of times the simulation waited for a free buffer
+    size_t deepest;        // largest number of snapshots waiting
+    size_t bytes;          // bytes of the snapshots written, without padding or lead
+    chrono::steady_clock::duration waited;   // time the simulation waited
+    chrono::steady_clock::duration writing;  // time spent writing, summed over the tasks
+    double bound[FIELDS];  // largest error of each field
+};
+
+//
+// writeFully: Writes the count pieces of iov to the file from the given
+// offset on, in as many calls as it takes, which are added to calls; returns
+// whether all were written.
+//
+bool writeFully(int fd, iovec* iov, int count, off_t offset, long& calls) {
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+        ssize_t done = pwritev(fd, iov, count, offset);
+        calls++;
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return false;
+        offset += done;
+        while (count > 0 && static_cast<size_t>(done) >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+//
+// openDump: Opens a file for writing snapshots, with O_DIRECT if the dumper
+// writes directly and the file system supports it.
+//
+int openDump(Dumper& dumper, const string& filename) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = dumper.direct ? open(filename.c_str(), flags | O_DIRECT, 0644) : -1;
+    if (fd < 0 && dumper.direct && errno == EINVAL && dumper.direct.exchange(false))
+        cerr << "Warning: No O_DIRECT for " << filename << ", writing through the page cache" << endl;
+    if (fd < 0)
+        fd = open(filename.c_str(), flags, 0644);
+    return fd;
+}
+
+//
+// closeDump: Cuts a file of its own back to the size of its snapshot if it was
+// padded, and closes it; returns whether the snapshot was written.
+//
+bool closeDump(const Dump& dump, int fd, bool ok) {
+    if (ok && dump.length != dump.size)
+        ok = ftruncate(fd, dump.size) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok)
+        cerr << "Error: Cannot write file " << dump.filename << endl;
+    return ok;
+}
+
+//
+// finishBatch: Accounts for a batch of snapshots taken from the queue and
+// written (or not) in the given time, and frees their buffers. Only the bytes
+// of the snapshots count, not the bytes of O_DIRECT around them.
+//
+void finishBatch(Dumper& dumper, const vector<int>& batch, const vector<bool>& ok,
+                 long calls, chrono::steady_clock::duration writing) {
+    lock_guard<mutex> lock(dumper.lock);
+    for (size_t k = 0; k < batch.size(); k++) {
+        if (ok[k]) {
+            dumper.written++;
+            dumper.bytes += dumper.buffers[batch[k]].size;
+        }
+        else {
+            dumper.failed++;
+        }
+        dumper.free.push_back(batch[k]);
+    }
+    dumper.calls += calls;
+    dumper.writing += writing;
+    dumper.changed.notify_all();
+}
+
+//
+// takeBatch: Takes up to count queued snapshots off the queue; returns false
+// if the queue is empty, and the task calling ends.
+//
+bool takeBatch(Dumper& dumper, size_t count, vector<int>& batch) {
+    lock_guard<mutex> lock(dumper.lock);
+    if (dumper.queue.empty()) {
+        dumper.writers--;
+        return false;
+    }
+    count = min(count, dumper.queue.size());
+    batch.assign(dumper.queue.begin(), dumper.queue.begin() + count);
+    dumper.queue.erase(dumper.queue.begin(), dumper.queue.begin() + count);
+    return true;
+}
+
+//
+// writeDumps: Body of a task of DUMP_WRITE, DUMP_WRITEV or DUMP_POOL; writes
+// the queued snapshots until the queue is empty.
+//
+void writeDumps(Dumper& dumper) {
+    const bool gather = dumper.trajectory >= 0 && dumper.mode == DUMP_WRITEV;
+    vector<int> batch;
+    while (takeBatch(dumper, gather ? dumper.buffers.size() : 1, batch)) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        long calls = 0;
+        vector<bool> ok(batch.size(), false);
+        if (dumper.trajectory >= 0) {
+            // the snapshots of a batch lie one after the other in the trajectory
+            vector<iovec> iov(batch.size());
+            for (size_t k = 0; k < batch.size(); k++) {
+                const Dump& dump = dumper.buffers[batch[k]];
+                iov[k].iov_base = dump.data;
+                iov[k].iov_len = dump.length;
+            }
+            bool written = writeFully(dumper.trajectory, iov.data(), static_cast<int>(iov.size()),
+                                      dumper.buffers[batch[0]].offset, calls);
+            if (!written)
+                cerr << "Error: Cannot write file " << trajectoryFile << endl;
+            ok.assign(batch.size(), written);
+        }
+        else {
+            const Dump& dump = dumper.buffers[batch[0]];
+            int fd = openDump(dumper, dump.filename);
+            iovec iov = { dump.data, dump.length };
+            if (fd < 0)
+                cerr << "Error: Cannot write file " << dump.filename << endl;
+            else
+                ok[0] = closeDump(dump, fd, writeFully(fd, &iov, 1, 0, calls));
+        }
+        finishBatch(dumper, batch, ok, calls, chrono::steady_clock::now() - t0);
+    }
+}
+
+//
+// startRing: Sets up an io_uring with an entry per buffer of the dumper and
+// registers the buffers with it; returns false if the kernel refuses.
+//
+bool startRing(Ring& ring, const vector<Dump>& buffers) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(buffers.size()), &params));
+    if (ring.fd < 0)
+        return false;
+    ring.entries = params.sq_entries;
+    ring.sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring.sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        ring.sqBytes = ring.cqBytes = max(ring.sqBytes, ring.cqBytes);
+    ring.sqRing = mmap(nullptr, ring.sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    ring.cqRing = single ? ring.sqRing : mmap(nullptr, ring.cqBytes, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, ring.sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    bool mapped = ring.sqRing != MAP_FAILED && ring.cqRing != MAP_FAILED && sqes != MAP_FAILED;
+    if (mapped) {
+        char* sq = static_cast<char*>(ring.sqRing);
+        char* cq = static_cast<char*>(ring.cqRing);
+        ring.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring.sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring.sqes = static_cast<io_uring_sqe*>(sqes);
+        ring.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring.cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        vector<iovec> iov(buffers.size());
+        for (size_t b = 0; b < buffers.size(); b++) {
+            iov[b].iov_base = buffers[b].data;
+            iov[b].iov_len = buffers[b].capacity;
+        }
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov.data(),
+                    static_cast<unsigned>(iov.size())) == 0)
+            return true;
+    }
+    if (sqes != MAP_FAILED)
+        munmap(sqes, ring.sqeBytes);
+    if (ring.cqRing != MAP_FAILED && !single)
+        munmap(ring.cqRing, ring.cqBytes);
+    if (ring.sqRing != MAP_FAILED)
+        munmap(ring.sqRing, ring.sqBytes);
+    close(ring.fd);
+    return false;
+}
+
+//
+// stopRing: Releases the io_uring.
+//
+void stopRing(Ring& ring) {
+    munmap(ring.sqes, ring.sqeBytes);
+    if (ring.cqRing != ring.sqRing)
+        munmap(ring.cqRing, ring.cqBytes);
+    munmap(ring.sqRing, ring.sqBytes);
+    close(ring.fd);
+}
+
+//
+// ringDumps: Body of the task of DUMP_URING; takes all the queued snapshots
+// (up to the size of the ring) at once, submits a write from the registered
+// buffer of each in one call and waits for their completions, until the
+// queue is empty. A short write is completed with
+// pwritev(). If the ring fails, the writes the kernel has taken are still
+// waited for (by polling the completion queue), so that no buffer is reused
+// while it is being read; the other snapshots of the batch fail, the ring
+// is released and the task goes on as a writer of DUMP_POOL.
+//
+void ringDumps(Dumper& dumper) {
+    Ring& ring = dumper.ring;
+    vector<int> batch;
+    while (takeBatch(dumper, ring.entries, batch)) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        const size_t count = batch.size();
+        vector<int> fds(count, dumper.trajectory);
+        vector<bool> ok(count, false);
+        vector<long> results(count, -1);
+        long calls = 0;
+        unsigned tail = *ring.sqTail;
+        unsigned submitted = 0;
+        for (size_t k = 0; k < count; k++) {
+            const Dump& dump = dumper.buffers[batch[k]];
+            if (dumper.trajectory < 0)
+                fds[k] = openDump(dumper, dump.filename);
+            if (fds[k] < 0) {
+                cerr << "Error: Cannot write file " << dump.filename << endl;
+                continue;
+            }
+            io_uring_sqe& sqe = ring.sqes[tail & *ring.sqMask];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITE_FIXED;
+            sqe.fd = fds[k];
+            sqe.addr = reinterpret_cast<uintptr_t>(dump.data);
+            sqe.len = static_cast<unsigned>(dump.length);
+            sqe.off = dump.offset;
+            sqe.buf_index = static_cast<uint16_t>(batch[k]);
+            sqe.user_data = k;
+            ring.sqArray[tail & *ring.sqMask] = tail & *ring.sqMask;
+            tail++;
+            submitted++;
+        }
+        __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+
+        // pending: the writes not yet taken by the kernel
+        unsigned pending = submitted, completed = 0;
+        int failure = 0;
+        while (completed < (failure ? submitted - pending : submitted)) {
+            int entered = 0;
+            if (!failure) {
+                entered = static_cast<int>(syscall(__NR_io_uring_enter, ring.fd, pending, submitted - completed,
+                                                   IORING_ENTER_GETEVENTS, nullptr, 0));
+                calls++;
+                if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    failure = errno;
+            }
+            else {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            if (entered > 0)
+                pending -= min(pending, static_cast<unsigned>(entered));
+            unsigned head = *ring.cqHead;
+            unsigned last = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+            for (; head != last; head++, completed++) {
+                const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+                results[cqe.user_data] = cqe.res;
+            }
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        for (size_t k = 0; k < count; k++) {
+            if (fds[k] < 0)
+                continue;
+            const Dump& dump = dumper.buffers[batch[k]];
+            size_t size = dump.length;
+            if (results[k] >= 0) {
+                iovec iov = { dump.data + results[k], size - results[k] };
+                ok[k] = static_cast<size_t>(results[k]) == size
+                    || writeFully(fds[k], &iov, 1, dump.offset + results[k], calls);
+            }
+            if (dumper.trajectory < 0)
+                ok[k] = closeDump(dump, fds[k], ok[k]);
+            else if (!ok[k])
+                cerr << "Error: Cannot write file " << trajectoryFile << endl;
+        }
+        finishBatch(dumper, batch, ok, calls, chrono::steady_clock::now() - t0);
+        if (failure) {
+            cerr << "Warning: io_uring failed (" << strerror(failure) << "), writing the snapshots on "
+                << DUMP_THREADS << " tasks" << endl;
+            stopRing(ring);
+            {
+                lock_guard<mutex> lock(dumper.lock);
+                dumper.mode = DUMP_POOL;
+            }
+            writeDumps(dumper);
+            return;
+        }
+    }
+}
+
+//
+// startDumper: Allocates the buffers for snapshots of n atoms in D dimensions,
+// opens the trajectory file if any, and sets up the io_uring of DUMP_URING.
+//
+void startDumper(Dumper& dumper, int n, int dimensions) {
+    size_t size = sizeof(SnapshotHeader) + snapshotBytes(n, dimensions);
+    // room for a lead of up to a block before the snapshot
+    size_t capacity = (size + 2 * DIRECT_ALIGN - 2) / DIRECT_ALIGN * DIRECT_ALIGN;
+    dumper.buffers.resize(dumpBuffers);
+    for (int b = 0; b < dumpBuffers; b++) {
+        Dump& dump = dumper.buffers[b];
+        dump.data = static_cast<unsigned char*>(aligned_alloc(DIRECT_ALIGN, capacity));
+        if (!dump.data) {
+            cerr << "Error: Cannot allocate the snapshot buffers" << endl;
+            exit(1);
+        }
+        memset(dump.data, 0, capacity);
+        dump.size = size;
+        dump.capacity = capacity;
+        dump.lead = dump.length = 0;
+        dump.offset = 0;
+        dumper.free.push_back(b);
+    }
+    dumper.writers = 0;
+    dumper.direct = dumpDirect;
+    dumper.trajectory = -1;
+    dumper.next = 0;
+    dumper.carry.assign(DIRECT_ALIGN, 0);
+    if (!trajectoryFile.empty()) {
+        dumper.trajectory = openDump(dumper, trajectoryFile);
+        if (dumper.trajectory < 0) {
+            cerr << "Error: Cannot open file " << trajectoryFile << endl;
+            exit(1);
+        }
+    }
+    dumper.written = dumper.failed = dumper.calls = dumper.stalls = 0;
+    dumper.deepest = 0;
+    dumper.bytes = 0;
+    dumper.waited = dumper.writing = chrono::steady_clock::duration::zero();
+    fill(dumper.bound, dumper.bound + FIELDS, 0.0);
+
+    dumper.mode = dumpMode;
+    if (dumper.mode == DUMP_URING && !startRing(dumper.ring, dumper.buffers)) {
+        cerr << "Warning: No io_uring (" << strerror(errno) << "), writing the snapshots on "
+            << DUMP_THREADS << " tasks" << endl;
+        dumper.mode = DUMP_POOL;
+    }
+}
+
+//
+// dump: Encodes the atoms into a free buffer, waiting for one if need be, and
+// queues it as the snapshot of the given frame, spawning a task to write it
+// unless as many are running as the mode allows.
+//
+template <class Real, int D>
+void dump(Dumper& dumper, int frame, int n, Atom<Real, D> atoms[]) {
+    unique_lock<mutex> lock(dumper.lock);
+    if (dumper.free.empty()) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        dumper.stalls++;
+        dumper.changed.wait(lock, [&] { return !dumper.free.empty(); });
+        dumper.waited += chrono::steady_clock::now() - t0;
+    }
+    int b = dumper.free.back();
+    dumper.free.pop_back();
+    lock.unlock();
+
+    Dump& buffer = dumper.buffers[b];
+    // in a trajectory written with O_DIRECT, the snapshot follows the part
+    // of its first block already taken by the previous one
+    const bool whole = dumper.trajectory >= 0 && dumper.direct;
+    buffer.lead = whole ? static_cast<size_t>(dumper.next) % DIRECT_ALIGN : 0;
+    buffer.offset = dumper.trajectory >= 0 ? dumper.next - static_cast<off_t>(buffer.lead) : 0;
+    memcpy(buffer.data, dumper.carry.data(), buffer.lead);
+    SnapshotHeader header;
+    unsigned char* snapshot = buffer.data + buffer.lead;
+    encodeSnapshot(n, atoms, header, snapshot + sizeof(header));
+    header.frame = frame;
+    memcpy(snapshot, &header, sizeof(header));
+    buffer.filename = framed(snapshotFile, frame);
+    // the whole blocks, the rest of the last one being written with the next
+    // snapshot; a file of its own is padded instead
+    const size_t end = buffer.lead + buffer.size;
+    buffer.length = end;
+    if (whole) {
+        buffer.length = end / DIRECT_ALIGN * DIRECT_ALIGN;
+        memcpy(dumper.carry.data(), buffer.data + buffer.length, end - buffer.length);
+    }
+    else if (dumper.direct) {
+        buffer.length = (end + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    }
+    if (dumper.trajectory >= 0)
+        dumper.next += buffer.size;
+    // half a step, plus the rounding of the values to Real
+    for (int f = 0; f < FIELDS; f++) {
+        double hi = header.lo[f] + 65535 * header.step[f];
+        double rounding = numeric_limits<Real>::epsilon() * max(fabs(header.lo[f]), fabs(hi));
+        dumper.bound[f] = max(dumper.bound[f], header.step[f] / 2 + rounding);
+    }
+
+    lock.lock();
+    dumper.queue.push_back(b);
+    dumper.deepest = max(dumper.deepest, dumper.queue.size());
+    if (dumper.writers < (dumper.mode == DUMP_POOL ? DUMP_THREADS : 1)) {
+        dumper.writers++;
+        if (dumper.mode == DUMP_URING)
+            scheduler().spawn(dumper.tasks, PRIORITY_LOW, [&dumper] { ringDumps(dumper); });
+        else
+            scheduler().spawn(dumper.tasks, PRIORITY_LOW, [&dumper] { writeDumps(dumper); });
+    }
+}
+
+//
+// stopDumper: Waits until all queued snapshots are written, releases the
+// buffers and prints the statistics of the snapshots (their bytes per atom
+// and rate without the padding of O_DIRECT), of the back-pressure and the
+// error bound of each field.
+//
+void stopDumper(Dumper& dumper, int n) {
+    scheduler().wait(dumper.tasks);
+    // the last, partial block of a trajectory written with O_DIRECT
+    const size_t tail = static_cast<size_t>(dumper.next) % DIRECT_ALIGN;
+    if (dumper.trajectory >= 0 && dumper.direct && tail > 0) {
+        unsigned char* block = dumper.buffers[0].data;
+        memcpy(block, dumper.carry.data(), tail);
+        memset(block + tail, 0, DIRECT_ALIGN - tail);
+        iovec iov = { block, DIRECT_ALIGN };
+        if (!writeFully(dumper.trajectory, &iov, 1, dumper.next - static_cast<off_t>(tail), dumper.calls)
+            || ftruncate(dumper.trajectory, dumper.next) != 0)
+            cerr << "Error: Cannot write file " << trajectoryFile << endl;
+    }
+    if (dumper.mode == DUMP_URING)
+        stopRing(dumper.ring);
+    if (dumper.trajectory >= 0 && close(dumper.trajectory) != 0)
+        cerr << "Error: Cannot write file " << trajectoryFile << endl;
+    for (Dump& buffer : dumper.buffers)
+        free(buffer.data);
+
+    static const char* modes[] = { "write", "writev", "io_uring", "pool" };
+    static const char* names[FIELDS] = { "r", "x", "y", "z", "vx", "vy", "vz" };
+    double seconds = chrono::duration<double>(dumper.writing).count();
+    cout << "Snapshots written: " << dumper.written
+        << ", failed: " << dumper.failed
+        << ", bytes per atom: "
+        << (dumper.written > 0 ? double(dumper.bytes) / dumper.written / n : 0.0)
+        << ", writer: " << modes[dumper.mode] << (dumper.direct ? " (direct)" : "")
+        << ", calls: " << dumper.calls
+        << ", MB/s: " << (seconds > 0 ? dumper.bytes / seconds / 1e6 : 0.0)
+        << ", stalls: " << dumper.stalls
+        << " (" << chrono::duration<double, milli>(dumper.waited).count() << " ms)"
+        << ", deepest queue: " << dumper.deepest << " of " << dumper.buffers.size()
+        << ", error bounds: color 0";
+    for (int f = 0; f < FIELDS; f++)
+        if (offsetOf(f, dimensions) >= 0)
+            cout << ", " << names[f] << " " << dumper.bound[f];
+    cout << endl;
+}
+
+//
+// simulate: Creates the drawing window, initializes the n atoms (either randomly or from file),
+// draws the initial state, waits for the user to press Enter, then performs F frames
+// paced to a period of S milliseconds, each advancing the atoms by one time unit in as
+// many physics steps as the frame period allows (or in steps of timeStep), and writing a thumbnail every thumbEvery
+// frames and a snapshot every snapshotEvery frames. Finally, it reports the frame statistics, cleans up and waits until the user
+// closes the window. In a headless run, there is no window and every frame takes one step.
+//
+template <class Real, int D, class Boundary, class Broadphase, class Collision>
+int simulate(int n, int argc, const char* argv[])
+{
+    if (!headless)
+        beginDrawing(W, H, "Atoms", 0xFFFFFF, false);
+    initStamps();
+    initCoverages();
+    Atom<Real, D>* atoms = new Atom<Real, D>[n];
     init(n, atoms, argc, argv);
-    draw(n, atoms);
+    Broadphase broadphase;
+    Collision collision;
+    Forces<Real> forces;
+    startForces<Boundary>(n, atoms, forces);
+    double reach = 0;
+    for (int i = 0; i < n; i++)
+        reach = max(reach, double(atoms[i].r));
+    startScene(reach);
+    startBox(n, atoms);
+    recordTrails(n, atoms);
 
-    cout << "Press <ENTER> to continue..." << endl;
-    string s;
-    getline(cin, s);
+    if (!headless) {
+        draw(getSurface(), n, atoms);
+        cout << "Press <ENTER> to continue..." << endl;
+        string s;
+        getline(cin, s);
+    }
 
+    Writer writer;
+    if (thumbEvery > 0)
+        startWriter(writer);
+    Dumper dumper;
+    if (snapshotEvery > 0)
+        startDumper(dumper, n, D);
+    Pacer pacer;
+    startPacing(pacer, S);
     for (int i = 0; i < F; i++)
     {
-        update(n, atoms);
-        draw(n, atoms);
-        this_thread::sleep_for(chrono::milliseconds(S));
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (timeStep > 0)
+            pacer.steps = max(1, static_cast<int>(lround(1 / timeStep)));
+        else if (forces.maxStep > 0)
+            pacer.steps = max(pacer.steps, static_cast<int>(min(ceil(1 / forces.maxStep), double(MAX_STEPS))));
+        Real dt = Real(1) / pacer.steps;
+        for (int k = 0; k < pacer.steps; k++)
+            update<Boundary>(n, atoms, dt, broadphase, collision, forces);
+        recordTrails(n, atoms);
+        // the snapshots and thumbnails are not counted as step time, nor as
+        // drawing time
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        if (snapshotEvery > 0 && (i + 1) % snapshotEvery == 0)
+            dump(dumper, i + 1, n, atoms);
+        if (thumbEvery > 0 && (i + 1) % thumbEvery == 0)
+            thumbnail(writer, i + 1, n, atoms);
+        if (!headless) {
+            chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+            draw(getSurface(), n, atoms);
+            chrono::steady_clock::time_point t3 = chrono::steady_clock::now();
+            pace(pacer, t1 - t0, t3 - t2);
+        }
     }
+    if (thumbEvery > 0)
+        stopWriter(writer);
+    if (snapshotEvery > 0)
+        stopDumper(dumper, n);
+    if (boundaryMode == BOUNDARY_PISTONS)
+        reportBox();
 
     delete[] atoms;
-    cout << "Close window to exit..." << endl;
-    endDrawing();
+    if (!headless) {
+        report(pacer, getSurface().getPresentation());
+        cout << "Close window to exit..." << endl;
+        endDrawing();
+    }
     return 0;
 }
+
+//
+// dispatch: Selects the instantiation of simulate() for the configuration
+// given by the options, one policy at a time.
+//
+// The inelastic collision model exists for discs only; options() rejects it
+// in 3D, where it is never selected.
+template <class Real, int D>
+struct InelasticOf {
+    typedef Inelastic<Real> type;
+};
+
+template <class Real>
+struct InelasticOf<Real, 3> {
+    typedef Elastic<Real> type;
+};
+
+template <class Real, int D, class Boundary, class Broadphase>
+int dispatch(int n, int argc, const char* argv[]) {
+    bool inelastic = collisionMode == COLLISION_INELASTIC
+        || (collisionMode == COLLISION_AUTO
+            && (restitution < 1 || friction > 0 || inelasticSpecies() || inelasticAtoms));
+    if (inelastic)
+        return simulate<Real, D, Boundary, Broadphase, typename InelasticOf<Real, D>::type>(n, argc, argv);
+    return simulate<Real, D, Boundary, Broadphase, Elastic<Real> >(n, argc, argv);
+}
+
+template <class Real, int D, class Boundary>
+int dispatch(int n, int argc, const char* argv[]) {
+    if (potential == POTENTIAL_LJ || potential == POTENTIAL_WCA)
+        return dispatch<Real, D, Boundary, NoPairs>(n, argc, argv);
+    bool grid = broadphaseMode == BROADPHASE_GRID
+        || (broadphaseMode == BROADPHASE_AUTO && n >= GRID_N);
+    if (grid)
+        return dispatch<Real, D, Boundary, Grid<D> >(n, argc, argv);
+    return dispatch<Real, D, Boundary, AllPairs>(n, argc, argv);
+}
+
+template <class Real, int D>
+int dispatch(int n, int argc, const char* argv[]) {
+    if (boundaryMode == BOUNDARY_PERIODIC)
+        return dispatch<Real, D, Periodic>(n, argc, argv);
+    if (boundaryMode == BOUNDARY_PISTONS)
+        return dispatch<Real, D, MovingWalls>(n, argc, argv);
+    return dispatch<Real, D, Walls>(n, argc, argv);
+}
+
+template <class Real>
+int dispatch(int n, int argc, const char* argv[]) {
+    if (dimensions == 3)
+        return dispatch<Real, 3>(n, argc, argv);
+    return dispatch<Real, 2>(n, argc, argv);
+}
+
+int dispatch(int n, int argc, const char* argv[]) {
+    if (precision == PRECISION_FLOAT)
+        return dispatch<float>(n, argc, argv);
+    return dispatch<double>(n, argc, argv);
+}
+
+//
+// main: Processes the command line options, determines the number of atoms and
+// runs the simulation in the configuration selected by the options.
+//
+int main(int argc, const char* argv[])
+{
+    options(argc, argv);
+    int n = number(argc, argv);
+    return dispatch(n, argc, argv);
+}